@@ -31,6 +31,11 @@ struct {
   // Sorted by how recently the buffer was used.
   // head.next is most recent, head.prev is least.
   struct buf head;
+
+  // bread() calls that found the block cached, and that
+  // had to read it from disk. Updated atomically.
+  int hits;
+  int misses;
 } bcache;
 
 void
@@ -96,12 +101,23 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if(!b->valid) {
+    __sync_fetch_and_add(&bcache.misses, 1);
     virtio_disk_rw(b, 0);
     b->valid = 1;
+  } else {
+    __sync_fetch_and_add(&bcache.hits, 1);
   }
   return b;
 }
 
+// Report buffer cache hits and misses since boot.
+void
+bstats(uint64 *hits, uint64 *misses)
+{
+  *hits = lockfree_read4(&bcache.hits);
+  *misses = lockfree_read4(&bcache.misses);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -84,6 +84,10 @@ consoleread(int user_dst, uint64 dst, int n)
   char cbuf;
 
   target = n;
+  // the copies are made with cons.lock held; at most a buffer's
+  // worth of input comes between sleeps.
+  if(user_dst && uaccess_touch(dst, n < INPUT_BUF_SIZE ? n : INPUT_BUF_SIZE, 1) < 0)
+    return -1;
   acquire(&cons.lock);
   while(n > 0){
     // wait until interrupt handler has put some
@@ -94,6 +98,12 @@ consoleread(int user_dst, uint64 dst, int n)
         return -1;
       }
       sleep(&cons.r, &cons.lock);
+      if(user_dst){
+        release(&cons.lock);
+        if(uaccess_touch(dst, n < INPUT_BUF_SIZE ? n : INPUT_BUF_SIZE, 1) < 0)
+          return n < target ? target - n : -1;
+        acquire(&cons.lock);
+      }
     }
 
     c = cons.buf[cons.r++ % INPUT_BUF_SIZE];
@@ -141,6 +151,10 @@ consoleintr(int c)
   case C('P'):  // Print process list.
     procdump();
     break;
+  case C('F'):  // Print free memory report.
+    kmemdump();
+    slabdump();
+    break;
   case C('U'):  // Kill line.
     while(cons.e != cons.w &&
           cons.buf[(cons.e-1) % INPUT_BUF_SIZE] != '\n'){
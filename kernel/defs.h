@@ -1,9 +1,12 @@
 struct buf;
 struct context;
+struct execimage;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
+struct shm;
 struct spinlock;
 struct sleeplock;
 struct stat;
@@ -13,6 +16,8 @@ struct mbuf;
 struct sock;
 #endif
 struct sysinfo;
+struct spawnfa;
+struct uaccess;
 
 // bio.c
 void            binit(void);
@@ -21,6 +26,7 @@ void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+void            bstats(uint64*, uint64*);
 
 // console.c
 void            consoleinit(void);
@@ -28,6 +34,11 @@ void            consoleintr(int);
 void            consputc(int);
 
 // exec.c
+int             execload(struct proc*, char*, char**, struct execimage*);
+int             execfault(struct proc*, uint64);
+void            execdup(struct proc*, struct proc*);
+void            exectrim(struct proc*, uint64);
+void            execput(struct proc*);
 int             exec(char*, char**);
 
 // file.c
@@ -68,11 +79,32 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            kinithart(void);
+int             kgrow(void);
+void*           kalloc_zeroed(void);
+void            kzero_fill(int);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+void            kmemdump(void);
 int             kfreemem(void);
 uint64          free_physical_memory(void);
 void            kreference(void *);
-void            kdereference(void *);
-char            knumreference(void *);
+int             kdereference(void *);
+int             knumreference(void *);
+uint            kpageflags(void *, uint);
+void            kpageset(void *, uint);
+void            kpageclear(void *, uint);
+uint64          kcowpages(void);
+int             kswapslot(void *);
+void            ksetswapslot(void *, int);
+int             kptes(void *, int);
+
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint, void (*)(void*));
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+void            slabdump(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -80,7 +112,15 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// mmap.c
+uint64          mmapbase(struct proc*);
+int             mmapfault(struct proc*, uint64, int);
+int             mmapprefault(struct proc*);
+int             mmapcopy(struct proc*, struct proc*);
+void            munmapall(struct proc*);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -96,6 +136,7 @@ void            backtrace(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             spawn(char*, char**, struct spawnfa*, int);
 void            trace(int);
 int             growproc(int);
 void            proc_mapstacks(pagetable_t);
@@ -119,10 +160,50 @@ int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
 uint64          num_procs(void);
+uint64          num_procs_state(int);
+
+// shm.c
+void            shminit(void);
+struct shm*     shmget(int, int);
+void            shmdup(struct shm*);
+void            shmput(struct shm*);
+char*           shmpage(struct shm*, uint64);
+
+// textcache.c
+void            textinit(void);
+char*           textget(uint, uint, uint64, uint);
+char*           textadd(uint, uint, uint64, uint, char*);
+void            textinval(uint, uint);
+
+// swap.c
+void            swapinit(void);
+void            swapdup(int);
+void            swapfree(int);
+uint64          swapspace(void);
+uint64          swapused(void);
+void            swapstats(uint64*, uint64*, uint64*, uint64*);
+void            swapreclaim(void);
+int             swapin(struct proc*, uint64);
+
+// ksm.c
+void            ksmscan(void);
+void            ksmstats(uint64*, uint64*);
+
+// zram.c
+void            zraminit(void);
+int             zramput(char*);
+void            zramget(int, char*);
+void            zramdup(int);
+void            zramfree(int);
+void            zramstats(uint64*, uint64*);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// ucopy.S
+int             ucopy(void*, void*, uint64);
+int             ucopystr(char*, char*, uint64);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
@@ -130,6 +211,7 @@ void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
+int             holdingspin(void);
 uint64          lockfree_read8(uint64 *addr);
 int             lockfree_read4(int *addr);
 #ifdef LAB_LOCK
@@ -178,22 +260,46 @@ int             uartgetc(void);
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
+pagetable_t     kvmcreate(pagetable_t);
+void            kvmuser(struct proc*);
+void            kvmswitch(pagetable_t);
+int             uvmkmap(pagetable_t);
+void            uvmkunmap(pagetable_t);
+uint64          uvmsatp(struct proc*);
+void            tlbflush(pagetable_t, uint64, uint64);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
+int             uvmcut(pagetable_t, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
+int             uvmdrop(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopyrange(pagetable_t, pagetable_t, uint64, uint64, int);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+int             uvmreserve(pagetable_t, uint64, uint64);
+int             uvmlazy(pagetable_t, uint64, uint64, int);
+int             uvmfaultin(struct proc*, uint64, int);
+int             uvmcow(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
+pte_t *         walkleaf(pagetable_t, uint64, int*);
+pagetable_t     walkpt(pagetable_t, uint64);
+pte_t *         walkswap(pagetable_t, uint64);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
+void            uaccess_init(struct uaccess*, pagetable_t);
+uint64          uaccess_addr(struct uaccess*, uint64, int);
+int             uaccess_touch(uint64, uint64, int);
+int             uaccess_copyout(struct uaccess*, uint64, char *, uint64);
+int             uaccess_copyin(struct uaccess*, char *, uint64, uint64);
+int             uaccess_copyinstr(struct uaccess*, char *, uint64, uint64);
 void            vmprint(pagetable_t);
+int             pgstate(struct proc*, uint64, int, uint64, uint64, int);
 #ifdef LAB_PGTBL
 int             pgaccess(pagetable_t, uint64, int, uint64);
 #endif
@@ -244,6 +350,7 @@ void            e1000_intr(void);
 int             e1000_transmit(struct mbuf*);
 
 // net.c
+void            mbufinit(void);
 void            net_rx(struct mbuf*);
 void            net_tx_udp(struct mbuf*, uint32, uint16, uint16);
 
@@ -5,6 +5,9 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 #include "elf.h"
 
 static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
@@ -19,8 +22,14 @@ int flags2perm(int flags)
     return perm;
 }
 
+// Load the program at path into a new page table for p, with
+// arguments argv on its stack. Doesn't touch p's current memory.
+// The ELF segments are only recorded in im, to be read in page
+// by page by execfault(); im keeps a reference to the file.
+// On success returns argc, and fills in im.
+// Returns -1 on failure.
 int
-exec(char *path, char **argv)
+execload(struct proc *p, char *path, char **argv, struct execimage *im)
 {
   char *s, *last;
   int i, off;
@@ -28,8 +37,11 @@ exec(char *path, char **argv)
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
-  pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
+  struct execseg *seg;
+  pagetable_t pagetable = 0;
+
+  im->ip = 0;
+  im->nseg = 0;
 
   begin_op();
 
@@ -73,10 +85,10 @@ exec(char *path, char **argv)
     }
     *arg = 0;
 
+    iunlockput(ip);
     end_op();
-    iunlock(ip);
 
-    return exec(buf, args);
+    return execload(p, buf, args, im);
   }
 
   // Check ELF header
@@ -89,7 +101,7 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record the program's segments.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -99,31 +111,52 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    if(ph.vaddr % PGSIZE != 0)
+    if(ph.vaddr + ph.memsz > PLIC)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.vaddr < sz)
       goto bad;
+    if(im->nseg == NEXECSEG){
+      // no room to record it; read it in now.
+      uint64 sz1;
+      if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+        goto bad;
+      sz = sz1;
+      if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+        goto bad;
+      continue;
+    }
+    seg = &im->seg[im->nseg++];
+    seg->va = ph.vaddr;
+    seg->memsz = ph.memsz;
+    seg->filesz = ph.filesz;
+    seg->off = ph.off;
+    seg->perm = flags2perm(ph.flags);
+    sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  // from now on writei() and open() refuse to change the file,
+  // whose pages execfault() has yet to read.
+  __sync_fetch_and_add(&ip->nexec, 1);
+  iunlock(ip);
   end_op();
+  im->ip = ip;
   ip = 0;
 
-  p = myproc();
-  uint64 oldsz = p->sz;
-
   // Allocate two pages at the next page boundary.
   // Make the first inaccessible as a stack guard.
   // Use the second as the user stack.
+  // Being mapped, they also keep uvmlazy() from putting a
+  // megapage over segment pages that haven't been read in.
   sz = PGROUNDUP(sz);
+  if(sz + 2*PGSIZE > PLIC)
+    goto bad;
   uint64 sz1;
   if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE, PTE_W)) == 0)
     goto bad;
   sz = sz1;
   uvmclear(pagetable, sz-2*PGSIZE);
+  im->guard = sz-2*PGSIZE;
   sp = sz;
   stackbase = sp - PGSIZE;
 
@@ -149,23 +182,68 @@ exec(char *path, char **argv)
   if(copyout(pagetable, sp, (char *)ustack, (argc+1)*sizeof(uint64)) < 0)
     goto bad;
 
-  // arguments to user main(argc, argv)
-  // argc is returned via the system call return
-  // value, which goes in a0.
-  p->trapframe->a1 = sp;
-
   // Save program name for debugging.
   for(last=s=path; *s; s++)
     if(*s == '/')
       last = s+1;
-  safestrcpy(p->name, last, sizeof(p->name));
-    
+  safestrcpy(im->name, last, sizeof(im->name));
+
+  im->pagetable = pagetable;
+  im->sz = sz;
+  im->entry = elf.entry;
+  im->sp = sp;
+  return argc;
+
+ bad:
+  if(pagetable)
+    proc_freepagetable(pagetable, sz);
+  if(ip){
+    iunlockput(ip);
+    end_op();
+  }
+  if(im->ip){
+    __sync_fetch_and_sub(&im->ip->nexec, 1);
+    begin_op();
+    iput(im->ip);
+    end_op();
+    im->ip = 0;
+  }
+  return -1;
+}
+
+int
+exec(char *path, char **argv)
+{
+  struct proc *p = myproc();
+  pagetable_t oldpagetable;
+  uint64 oldsz = p->sz;
+  struct execimage im;
+  int argc;
+
+  if((argc = execload(p, path, argv, &im)) < 0)
+    return -1;
+
+  // arguments to user main(argc, argv)
+  // argc is returned via the system call return
+  // value, which goes in a0.
+  p->trapframe->a1 = im.sp;
+  safestrcpy(p->name, im.name, sizeof(p->name));
+
   // Commit to the user image.
+  munmapall(p);
+  execput(p);
   oldpagetable = p->pagetable;
-  p->pagetable = pagetable;
-  p->sz = sz;
-  p->trapframe->epc = elf.entry;  // initial program counter = main
-  p->trapframe->sp = sp; // initial stack pointer
+  p->pagetable = im.pagetable;
+  kvmuser(p);
+  // the new page table needs an ASID of its own.
+  p->asid = 0;
+  p->sz = im.sz;
+  p->exe = im.ip;
+  p->nseg = im.nseg;
+  memmove(p->seg, im.seg, sizeof(im.seg));
+  p->guard = im.guard;
+  p->trapframe->epc = im.entry;  // initial program counter = main
+  p->trapframe->sp = im.sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
 
   // Print startup pagetable
@@ -176,15 +254,123 @@ exec(char *path, char **argv)
 #endif
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
+}
+
+// Fault in the page at va of p's executable: its bytes from the
+// file, if any, followed by zeroes. A page of a read-only
+// segment is shared through the text cache (textcache.c) with
+// every other process running the same file. A write to a
+// read-only segment maps the page anyway, and faults again as
+// an error.
+// Returns 0 on success, 1 if va isn't an untouched page of one
+// of p's recorded segments. Failing to read a page that is one
+// kills p, rather than let the page be zero-filled, and returns -1.
+int
+execfault(struct proc *p, uint64 va)
+{
+  struct execseg *seg;
+  struct inode *ip = p->exe;
+  uint64 off, n = 0;
+  int r = 0, shared, mega;
+  char *mem;
+
+  va = PGROUNDDOWN(va);
+  for(seg = p->seg; seg < &p->seg[p->nseg]; seg++)
+    if(va >= seg->va && va < seg->va + seg->memsz)
+      break;
+  if(seg == &p->seg[p->nseg])
+    return 1;
+  // only a page that was never touched: not one on swap.
+  if(walkleaf(p->pagetable, va, &mega) != 0 || walkswap(p->pagetable, va) != 0)
+    return 1;
+
+  off = seg->off + (va - seg->va);
+  if(va < seg->va + seg->filesz){
+    n = seg->va + seg->filesz - va;
+    if(n > PGSIZE)
+      n = PGSIZE;
+  }
+  shared = (seg->perm & PTE_W) == 0 && n > 0;
+  if(shared && (mem = textget(ip->dev, ip->inum, off, n)) != 0)
+    goto map;
+
+  if((mem = kalloc_zeroed()) == 0)
+    goto bad;
+  if(n > 0){
+    // no inode is locked here: fileread() and filewrite() fault
+    // their buffers in first.
+    ilock(ip);
+    r = readi(ip, 0, (uint64)mem, off, n);
+    if(r == n && shared)
+      mem = textadd(ip->dev, ip->inum, off, n, mem);
+    iunlock(ip);
+    if(r != n){
+      kfree(mem);
+      goto bad;
+    }
+  }
+
+ map:
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, seg->perm | PTE_R | PTE_U) != 0){
+    if(!shared || kdereference(mem) == 1)
+      kfree(mem);
+    goto bad;
+  }
+  // the mapping now holds the page for the cache's caller.
+  if(shared)
+    kdereference(mem);
+  return 0;
 
  bad:
-  if(pagetable)
-    proc_freepagetable(pagetable, sz);
-  if(ip){
-    iunlockput(ip);
+  setkilled(p);
+  return -1;
+}
+
+// Forget the parts of p's segments at or above sz, which sbrk()
+// has shrunk p to, so that memory grown there again is zero.
+void
+exectrim(struct proc *p, uint64 sz)
+{
+  struct execseg *seg;
+
+  for(seg = p->seg; seg < &p->seg[p->nseg]; seg++){
+    if(seg->va >= sz){
+      seg->memsz = 0;
+      seg->filesz = 0;
+    } else if(seg->va + seg->memsz > sz){
+      seg->memsz = sz - seg->va;
+      if(seg->filesz > seg->memsz)
+        seg->filesz = seg->memsz;
+    }
+  }
+}
+
+// Give np, a child of p, p's executable and segments.
+void
+execdup(struct proc *np, struct proc *p)
+{
+  if(p->exe){
+    np->exe = idup(p->exe);
+    __sync_fetch_and_add(&np->exe->nexec, 1);
+  }
+  np->nseg = p->nseg;
+  memmove(np->seg, p->seg, sizeof(p->seg));
+  np->guard = p->guard;
+}
+
+// Drop p's reference to its executable, on exec() or exit().
+// p must not be in a file system transaction.
+void
+execput(struct proc *p)
+{
+  if(p->exe){
+    __sync_fetch_and_sub(&p->exe->nexec, 1);
+    begin_op();
+    iput(p->exe);
     end_op();
   }
-  return -1;
+  p->exe = 0;
+  p->nseg = 0;
 }
 
 // Load a program segment into pagetable at virtual address va.
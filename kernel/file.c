@@ -13,6 +13,13 @@
 #include "stat.h"
 #include "proc.h"
 
+// fileread() and filewrite() fault in the user buffer a chunk
+// at a time before locking the inode: faulting in a page of the
+// program or of an mmap()ed file locks that file's inode, and
+// doing so with another inode locked could deadlock against a
+// process locking the two the other way round.
+#define FILECHUNK (4*PGSIZE)
+
 struct devsw devsw[NDEV];
 struct {
   struct spinlock lock;
@@ -124,10 +131,29 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
+    int i = 0;
+    while(i < n){
+      int n1 = n - i;
+      if(n1 > FILECHUNK)
+        n1 = FILECHUNK;
+
+      if(uaccess_touch(addr + i, n1, 1) < 0){
+        r = -1;
+        break;
+      }
+      ilock(f->ip);
+      if((r = readi(f->ip, 1, addr + i, f->off, n1)) > 0)
+        f->off += r;
+      iunlock(f->ip);
+
+      if(r > 0)
+        i += r;
+      if(r != n1)
+        break;
+    }
+    // bytes read before an error or the end of the file.
+    if(i > 0)
+      r = i;
   }
 #ifdef LAB_NET
   else if(f->type == FD_SOCK){
@@ -173,6 +199,8 @@ filewrite(struct file *f, uint64 addr, int n)
       if(n1 > max)
         n1 = max;
 
+      if(uaccess_touch(addr + i, n1, 0) < 0)
+        break;
       begin_op();
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
@@ -25,6 +25,7 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  int nexec;          // processes running it; see execload()
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
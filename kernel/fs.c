@@ -429,6 +429,9 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  if(ip->type == T_FILE)
+    textinval(ip->dev, ip->inum);
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -512,6 +515,14 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  // a running program's pages are read from the file as it
+  // touches them.
+  if(ip->nexec > 0)
+    return -1;
+
+  // processes that exec ip from now on must see the change.
+  if(ip->type == T_FILE)
+    textinval(ip->dev, ip->inum);
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     uint addr = bmap(ip, off/BSIZE);
@@ -1,6 +1,7 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or physically contiguous power-of-two runs of them.
 
 #include "types.h"
 #include "param.h"
@@ -8,67 +9,363 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "page.h"
 
-// The xv6 has 128 * 1024 * 1024 bytes of phsical memory, which is
-// 32768 physical pages. Each page needs 4 bits for reference counting 
-// (xv6 supports at most 64 processes) (We give it one bytes for ease of implementation)
-// So 32768 pages needs 32768 bytes of memory for reference counting,
-// which is in turn 8 pages.
-// The [end..end+RC_MEM] physical memory range is used for the reference counting
-// array, and physical memory allocation starts at end+RC_MEM
-// Note that it is almost certainly wasteful to give whole 8 pages for reference counting
-// because kernel text areas and the ref counting areas themselves don't need reference counting
-// anyway
-#define RC_MEM 8 * PGSIZE
-#define PA2IDX(pa) (((uint64) pa - KERNBASE) / PGSIZE)
+// The [end..end+PAGES_MEM] physical memory range holds the
+// struct page array (see page.h), and physical memory allocation
+// starts at end+PAGES_MEM. Reference counts and flags are updated
+// with atomic instructions, so the COW fault and fork paths never
+// take an allocator lock to share or unshare a page.
+#define PAGES_MEM PGROUNDUP(NPAGES * sizeof(struct page))
+
+// Fill memory with junk to catch dangling refs, in MEMDEBUG
+// builds only; otherwise freeing and allocating never write
+// to the page itself.
+static inline void
+kjunk(void *pa, int c, uint n)
+{
+#ifdef MEMDEBUG
+  memset(pa, c, n);
+#endif
+}
 
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+struct page *pages = (struct page *)end;
+int ncowpages;    // # of pages with PG_COW set
+
 struct run {
   struct run *next;
 };
 
-struct {
+// Free pages move between a CPU's list and the buddy allocator
+// KBATCH at a time. A CPU list holding more than KHIGH pages
+// spills a batch back to the buddy allocator on kfree().
+#define KBATCH 32
+#define KHIGH  (4 * KBATCH)
+
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;              // number of pages on freelist
+};
+
+// Each CPU allocates from and frees to its own list, so the
+// common case only touches a lock no other CPU is spinning on.
+// A CPU whose list is empty refills from the buddy allocator,
+// and if that is empty too, steals from another CPU.
+struct kmem kmem[NCPU];
+
+// Pool of pages that are already zero, filled by idle CPUs from
+// scheduler(), so kalloc_zeroed() has no memset on its path.
+// A pooled page is zero except for its link word, which is
+// cleared when the page leaves the pool. Pooled pages still
+// count as free memory, and kalloc() falls back on them when
+// everything else is empty.
+#define KZEROMAX 256
+
+struct kmem kzero;
+
+// Physical memory comes online KCHUNK bytes at a time. kinit()
+// hands over only the chunk holding the end of the kernel; the
+// rest is claimed chunk by chunk by the other harts as they boot
+// (kinithart()), by idle CPUs, and by any allocation that finds
+// the buddy allocator empty, whichever gets there first.
+#define KCHUNK (PGSIZE << MAXORDER)
+
+uint64 knext;     // next chunk not yet claimed; may pass PHYSTOP
+
+// Binary buddy allocator, the shared pool behind the per-CPU
+// lists and the source of physically contiguous allocations.
+// A free block of 2^k pages starts at a page index (counting
+// from KERNBASE) that is a multiple of 2^k, and its buddy is
+// the block at index ^ 2^k. The head page of a free block has
+// PG_BUDDY set and k in its struct page; blocks of each order
+// are kept on a circular list threaded through the free pages.
+struct block {
+  struct block *next;
+  struct block *prev;
+};
+
+struct {
+  struct spinlock lock;
+  struct block free[MAXORDER+1]; // list heads, one per order
+  int nblock[MAXORDER+1];        // # of free blocks of each order
+  int npages;                    // total free pages
+} buddy;
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
-  // Clear the reference count memory region
-  memset((void *)end, 0, RC_MEM);
-  freerange(end + RC_MEM, (void*)PHYSTOP);
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&buddy.lock, "kmem_buddy");
+  initlock(&kzero.lock, "kmem_zero");
+  for(int k = 0; k <= MAXORDER; k++)
+    buddy.free[k].next = buddy.free[k].prev = &buddy.free[k];
+  // Clear the page metadata region
+  memset((void *)pages, 0, PAGES_MEM);
+  knext = KERNBASE + ((uint64)end + PAGES_MEM - KERNBASE + KCHUNK - 1) / KCHUNK * KCHUNK;
+  freerange(end + PAGES_MEM, (void*)knext);
 }
 
-static void kfree_init(void *);
+// Bring the next unclaimed chunk of physical memory online.
+// Returns 0 if all of memory is already online.
+int
+kgrow(void)
+{
+  uint64 pa = __sync_fetch_and_add(&knext, KCHUNK);
+
+  if(pa >= PHYSTOP)
+    return 0;
+  freerange((void *)pa, (void *)(pa + KCHUNK < PHYSTOP ? pa + KCHUNK : PHYSTOP));
+  return 1;
+}
 
+// Called by each hart other than 0 as it boots: bring memory
+// online in parallel with the other harts.
+void
+kinithart(void)
+{
+  uint64 t0 = r_time();
+  int n = 0;
+
+  while(kgrow())
+    n++;
+  if(n > 0)
+    printf("hart %d: %d MB online in %d us\n", cpuid(),
+           n * (KCHUNK >> 20), (r_time() - t0) * 1000000 / MTIME_HZ);
+}
+
+static void
+blist_push(int k, struct block *b)
+{
+  struct block *h = &buddy.free[k];
+
+  b->next = h->next;
+  b->prev = h;
+  h->next->prev = b;
+  h->next = b;
+  pages[PA2IDX(b)].order = k;
+  kpageset(b, PG_BUDDY);
+  buddy.nblock[k]++;
+}
+
+static void
+blist_remove(int k, struct block *b)
+{
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  kpageclear(b, PG_BUDDY);
+  buddy.nblock[k]--;
+}
+
+// Take a free block of 2^k pages, splitting a larger block if
+// there is none of the right size. buddy.lock must be held.
+// Returns 0 if no block is large enough.
+static void *
+buddy_take(int k)
+{
+  struct block *b;
+  int j;
+
+  for(j = k; j <= MAXORDER; j++)
+    if(buddy.free[j].next != &buddy.free[j])
+      break;
+  if(j > MAXORDER)
+    return 0;
+
+  b = buddy.free[j].next;
+  blist_remove(j, b);
+  // give back the upper half until the block is the right size.
+  while(j > k){
+    j--;
+    blist_push(j, (struct block *)((char *)b + (PGSIZE << j)));
+  }
+  buddy.npages -= 1 << k;
+  return b;
+}
+
+// Return a block of 2^k pages, coalescing it with its buddy
+// for as long as the buddy is a free block of the same order.
+// buddy.lock must be held.
+static void
+buddy_put(void *pa, int k)
+{
+  uint64 idx = PA2IDX(pa);
+
+  buddy.npages += 1 << k;
+  while(k < MAXORDER){
+    uint64 bidx = idx ^ (1L << k);
+    if(bidx >= NPAGES || (pages[bidx].flags & PG_BUDDY) == 0 ||
+       pages[bidx].order != k)
+      break;
+    blist_remove(k, IDX2PA(bidx));
+    idx &= ~(1L << k);
+    k++;
+  }
+  blist_push(k, IDX2PA(idx));
+}
+
+// Hand [pa_start, pa_end) to the buddy allocator, in the
+// largest aligned blocks that fit.
 void
 freerange(void *pa_start, void *pa_end)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE) {
-    kfree_init(p);
+  uint64 p = PGROUNDUP((uint64)pa_start);
+  int k;
+
+  while(p + PGSIZE <= (uint64)pa_end){
+    for(k = MAXORDER; k > 0; k--)
+      if(PA2IDX(p) % (1L << k) == 0 && p + (PGSIZE << k) <= (uint64)pa_end)
+        break;
+    kjunk((void *)p, 1, PGSIZE << k);
+    acquire(&buddy.lock);
+    buddy_put((void *)p, k);
+    release(&buddy.lock);
+    p += PGSIZE << k;
   }
 }
 
+// Detach up to n pages from the front of km's free list.
+// km->lock must be held. Returns the head of the detached
+// chain, or 0 if the list is empty; *tail and *cnt are set
+// to its last page and length.
+static struct run *
+ktake(struct kmem *km, int n, struct run **tail, int *cnt)
+{
+  struct run *head, *r;
+  int i;
+
+  head = km->freelist;
+  if(head == 0)
+    return 0;
+  r = head;
+  for(i = 1; i < n && r->next; i++)
+    r = r->next;
+  km->freelist = r->next;
+  km->nfree -= i;
+  r->next = 0;
+  *tail = r;
+  *cnt = i;
+  return head;
+}
+
+// Prepend the chain head..tail of cnt pages to km's free list.
+// km->lock must be held.
+static void
+kput(struct kmem *km, struct run *head, struct run *tail, int cnt)
+{
+  tail->next = km->freelist;
+  km->freelist = head;
+  km->nfree += cnt;
+}
+
+// Give a chain of single pages back to the buddy allocator.
 static void
-kfree_init(void *pa) {
+kspill(struct run *r)
+{
+  struct run *next;
+
+  acquire(&buddy.lock);
+  for(; r; r = next){
+    next = r->next;
+    buddy_put(r, 0);
+  }
+  release(&buddy.lock);
+}
+
+// Find a batch of free pages for CPU id, whose own list is empty:
+// first from the buddy allocator, bringing more memory online if
+// need be, otherwise by stealing half of another CPU's list.
+// Caller holds no kmem locks and has interrupts off.
+// Returns 0 if the system is out of memory.
+static struct run *
+krefill(int id, struct run **tail, int *cnt)
+{
+  struct run *head, *r;
+  int n;
+
+  do {
+    head = 0;
+    n = 0;
+    acquire(&buddy.lock);
+    while(n < KBATCH && (r = buddy_take(0)) != 0){
+      if(head == 0)
+        *tail = r;
+      r->next = head;
+      head = r;
+      n++;
+    }
+    release(&buddy.lock);
+    if(head){
+      *cnt = n;
+      return head;
+    }
+  } while(kgrow());
+
+  for(int i = 1; i < NCPU; i++){
+    struct kmem *victim = &kmem[(id + i) % NCPU];
+    acquire(&victim->lock);
+    n = (victim->nfree + 1) / 2;
+    if(n > KBATCH)
+      n = KBATCH;
+    head = ktake(victim, n, tail, cnt);
+    release(&victim->lock);
+    if(head)
+      return head;
+  }
+  return 0;
+}
+
+// Take a page from the zero pool, or return 0.
+static struct run *
+kzero_take(void)
+{
   struct run *r;
-  // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
 
-  r = (struct run*)pa;
+  acquire(&kzero.lock);
+  r = kzero.freelist;
+  if(r){
+    kzero.freelist = r->next;
+    kzero.nfree--;
+  }
+  release(&kzero.lock);
+  if(r){
+    if(kpageflags(r, PG_ZEROED) == 0)
+      panic("kzero_take");
+    kpageclear(r, PG_ZEROED);
+    r->next = 0;
+  }
+  return r;
+}
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+// Move every page on every CPU's list, and in the zero pool,
+// back to the buddy allocator so that they can coalesce into
+// larger blocks.
+static void
+kdrain(void)
+{
+  struct run *head, *tail, *r;
+  int cnt;
+
+  for(int i = 0; i < NCPU; i++){
+    acquire(&kmem[i].lock);
+    head = ktake(&kmem[i], kmem[i].nfree, &tail, &cnt);
+    release(&kmem[i].lock);
+    kspill(head);
+  }
+
+  acquire(&kzero.lock);
+  head = ktake(&kzero, kzero.nfree, &tail, &cnt);
+  release(&kzero.lock);
+  // the buddy allocator's pages aren't known to be zero.
+  for(r = head; r; r = r->next)
+    kpageclear(r, PG_ZEROED);
+  kspill(head);
 }
 
 // Free the page of physical memory pointed at by pa,
@@ -78,7 +375,9 @@ kfree_init(void *pa) {
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct kmem *km;
+  struct run *r, *head, *tail;
+  int cnt;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
@@ -90,16 +389,35 @@ kfree(void *pa)
     // panic("free referenced page %p, %d\n", pa, knumreference(pa));
     panic("kfree");
   }
+  if ((uint64) pa > KERNBASE && kpageflags(pa, PG_PINNED))
+    panic("kfree: pinned");
+  kpageclear(pa, PG_ZEROED | PG_COW);
+  // the copy on swap is no use to anyone now.
+  if ((uint64) pa > KERNBASE && kswapslot(pa) >= 0) {
+    swapfree(kswapslot(pa));
+    ksetswapslot(pa, -1);
+  }
+  if ((uint64) pa > KERNBASE)
+    pages[PA2IDX(pa)].nptes = 0;
 
-  // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  kjunk(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  r->next = km->freelist;
+  km->freelist = r;
+  km->nfree++;
+  head = 0;
+  if(km->nfree > KHIGH)
+    head = ktake(km, KBATCH, &tail, &cnt);
+  release(&km->lock);
+
+  if(head)
+    kspill(head);
+  pop_off();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -108,67 +426,244 @@ kfree(void *pa)
 void *
 kalloc(void)
 {
-  struct run *r;
+  struct kmem *km;
+  struct run *r, *tail;
+  int id, cnt;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  km = &kmem[id];
+  acquire(&km->lock);
+  r = km->freelist;
+  if(r){
+    km->freelist = r->next;
+    km->nfree--;
+  }
+  release(&km->lock);
 
+  if(r == 0 && (r = krefill(id, &tail, &cnt)) != 0 && cnt > 1){
+    // keep the first page, stash the rest of the batch
+    acquire(&km->lock);
+    kput(km, r->next, tail, cnt - 1);
+    release(&km->lock);
+  }
+  pop_off();
+
+  if(r == 0)
+    r = kzero_take();
   if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+    kjunk((char*)r, 5, PGSIZE);
   return (void*)r;
 }
 
-// Return the amount of free physical memory on the system
-int kfreemem(void)
+// Allocate one 4096-byte page of zeroed physical memory.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  void *pa;
+
+  if((pa = kzero_take()) != 0)
+    return pa;
+  if((pa = kalloc()) != 0)
+    memset(pa, 0, PGSIZE);
+  return pa;
+}
+
+// Zero up to n free pages into the zero pool, stopping when
+// it is full or memory runs out. Called by idle CPUs.
+void
+kzero_fill(int n)
 {
-  int count = 0;
   struct run *r;
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  while (r != 0) {
-    count += PGSIZE;
-    r = r->next;
+
+  for(; n > 0 && lockfree_read4(&kzero.nfree) < KZEROMAX; n--){
+    // the zero pool is kalloc()'s last resort, so this
+    // never eats into memory a process is waiting for.
+    if((r = kalloc()) == 0)
+      return;
+    memset(r, 0, PGSIZE);
+    kpageset(r, PG_ZEROED);
+    acquire(&kzero.lock);
+    r->next = kzero.freelist;
+    kzero.freelist = r;
+    kzero.nfree++;
+    release(&kzero.lock);
+  }
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their size. Returns 0 if no block that large is free.
+void *
+kalloc_pages(int order)
+{
+  void *pa;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
+
+  do {
+    acquire(&buddy.lock);
+    pa = buddy_take(order);
+    release(&buddy.lock);
+  } while(pa == 0 && kgrow());
+  if(pa == 0 && order > 0){
+    // the pages may be sitting on per-CPU lists; pull them
+    // back so they can coalesce, then try again.
+    kdrain();
+    acquire(&buddy.lock);
+    pa = buddy_take(order);
+    release(&buddy.lock);
+  }
+
+  if(pa)
+    kjunk(pa, 5, PGSIZE << order);
+  return pa;
+}
+
+// Free a block returned by kalloc_pages(order).
+void
+kfree_pages(void *pa, int order)
+{
+  char *p;
+
+  if(order < 0 || order > MAXORDER || PA2IDX(pa) % (1L << order) != 0)
+    panic("kfree_pages");
+  for(p = pa; p < (char *)pa + (PGSIZE << order); p += PGSIZE){
+    if(((uint64)p % PGSIZE) != 0 || p < end || (uint64)p >= PHYSTOP)
+      panic("kfree_pages");
+    if(knumreference(p) != 1 || kpageflags(p, PG_PINNED | PG_BUDDY))
+      panic("kfree_pages: in use");
+    kpageclear(p, PG_ZEROED | PG_COW);
+  }
+
+  kjunk(pa, 1, PGSIZE << order);
+
+  acquire(&buddy.lock);
+  buddy_put(pa, order);
+  release(&buddy.lock);
+}
+
+// Print the number of free blocks of each order and how much
+// of the free memory is too fragmented to satisfy a megapage
+// (2 MB) allocation. Runs when user types ^F on console.
+void
+kmemdump(void)
+{
+  int nblock[MAXORDER+1], npages, nsmall, nlist[NCPU];
+
+  acquire(&buddy.lock);
+  for(int k = 0; k <= MAXORDER; k++)
+    nblock[k] = buddy.nblock[k];
+  npages = buddy.npages;
+  release(&buddy.lock);
+  for(int i = 0; i < NCPU; i++)
+    nlist[i] = lockfree_read4(&kmem[i].nfree);
+
+  printf("\nbuddy: %d free pages\n", npages);
+  if(lockfree_read8(&knext) < PHYSTOP)
+    printf("offline: %d pages\n", (PHYSTOP - lockfree_read8(&knext)) / PGSIZE);
+  nsmall = 0;
+  for(int k = 0; k <= MAXORDER; k++){
+    printf("order %d (%d KB): %d free\n", k, 4 << k, nblock[k]);
+    if(k < MEGAORDER)
+      nsmall += nblock[k] << k;
   }
-  return count;
+  if(npages > 0)
+    printf("unusable for 2 MB: %d%%\n", nsmall * 100 / npages);
+  for(int i = 0; i < NCPU; i++)
+    if(nlist[i] > 0)
+      printf("cpu %d: %d pages cached\n", i, nlist[i]);
+  printf("zero pool: %d pages\n", lockfree_read4(&kzero.nfree));
 }
 
+// Return the amount of free physical memory on the system
+int kfreemem(void)
+{
+  return free_physical_memory();
+}
+
+// Sum the free-page counters of every list without taking
+// their locks, so monitoring never stalls an allocator. The
+// result is exact whenever no page is in flight between lists.
 uint64
 free_physical_memory(void) {
   uint64 count = 0;
-  struct run *r;
-  acquire(&kmem.lock);
 
-  r = kmem.freelist;
-  while (r) {
-    count += PGSIZE;
-    r = r->next;
-  }
+  for(int i = 0; i < NCPU; i++)
+    count += lockfree_read4(&kmem[i].nfree);
+  count += lockfree_read4(&buddy.npages);
+  count += lockfree_read4(&kzero.nfree);
+  // memory that is not online yet is free, too.
+  if(lockfree_read8(&knext) < PHYSTOP)
+    count += (PHYSTOP - lockfree_read8(&knext)) / PGSIZE;
 
-  release(&kmem.lock);
-  return count;
+  return count * PGSIZE;
 }
 
 // Add a reference count to pa as it is mapped to another
 // virtual address.
 void
 kreference(void *pa) {
-  acquire(&kmem.lock);
-  end[PA2IDX(pa)]++;
-  release(&kmem.lock);
+  __sync_fetch_and_add(&pages[PA2IDX(pa)].refcnt, 1);
 }
 
-void kdereference(void *pa) {
-  acquire(&kmem.lock);
-  end[PA2IDX(pa)]--;
-  release(&kmem.lock);
+// Drop a reference to pa as one of its mappings goes away.
+// Returns the number of references left, so that exactly one
+// caller sees the count fall back to the kernel's own mapping.
+int
+kdereference(void *pa) {
+  return __sync_sub_and_fetch(&pages[PA2IDX(pa)].refcnt, 1);
 }
 
-char knumreference(void *pa) {
-  acquire(&kmem.lock);
-  char ans = end[PA2IDX(pa)];
-  release(&kmem.lock);
-  return ans;
-}
\ No newline at end of file
+int
+knumreference(void *pa) {
+  return lockfree_read4(&pages[PA2IDX(pa)].refcnt);
+}
+
+// Return the subset of flags that are set for pa.
+uint
+kpageflags(void *pa, uint flags) {
+  return lockfree_read4((int *)&pages[PA2IDX(pa)].flags) & flags;
+}
+
+void
+kpageset(void *pa, uint flags) {
+  uint old = __sync_fetch_and_or(&pages[PA2IDX(pa)].flags, flags);
+  if((flags & ~old) & PG_COW)
+    __sync_fetch_and_add(&ncowpages, 1);
+}
+
+void
+kpageclear(void *pa, uint flags) {
+  uint old = __sync_fetch_and_and(&pages[PA2IDX(pa)].flags, ~flags);
+  if((flags & old) & PG_COW)
+    __sync_fetch_and_sub(&ncowpages, 1);
+}
+
+// Return the swap slot that holds a copy of pa, or -1.
+int
+kswapslot(void *pa) {
+  return pages[PA2IDX(pa)].swapslot - 1;
+}
+
+// Record that swap slot s, or none if -1, holds a copy of pa;
+// the page holds the slot's reference.
+void
+ksetswapslot(void *pa, int s) {
+  pages[PA2IDX(pa)].swapslot = s + 1;
+}
+
+// Add n to the count of non-zero PTEs in page-table page pa,
+// and return the new count. Only the page table's owner
+// changes it, so it needs no lock.
+int
+kptes(void *pa, int n) {
+  return pages[PA2IDX(pa)].nptes += n;
+}
+
+// Number of pages currently marked PG_COW.
+uint64
+kcowpages(void) {
+  return lockfree_read4(&ncowpages);
+}
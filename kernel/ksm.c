@@ -0,0 +1,220 @@
+// Same-page merging.
+//
+// Idle CPUs scan the memory of sleeping processes for pages with
+// the same contents and map one copy of each, copy-on-write, in
+// place of all of them. A write to the merged page copies it
+// back out, as after fork().
+//
+// Merged pages are kept in a table, each with a reference of the
+// table's own and a hash of its contents. A private page whose
+// hash and bytes match a merged page is replaced by it. A page
+// whose hash matches a page already seen in the current pass,
+// but no merged page, becomes a merged page itself: it is made
+// copy-on-write and added to the table, so the page it matched
+// merges with it when the scan gets there, in this pass or the
+// next. At the end of each pass, merged pages that no page table
+// maps any more are dropped.
+//
+// Like swap.c, the scan looks only at pages that one page table
+// maps, in a leaf table of its own, in processes that are asleep,
+// so that nothing else changes the PTEs it looks at.
+//
+// ksm() sets how many pages are scanned per clock tick; 0, the
+// default, turns scanning off.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "page.h"
+
+#define NKSMHASH 1024  // hashes of pages seen in a pass
+
+extern struct proc proc[NPROC];
+
+struct ksmpage {
+  uint64 hash;
+  char *pa;            // 0 if the entry is free
+};
+
+static struct {
+  int busy;            // a CPU is scanning
+  int rate;            // pages to scan per tick
+  int budget;          // pages left to scan this tick
+  uint lasttick;
+  int hand;            // process being scanned
+  uint64 handva;       // next address in it
+  uint64 seen[NKSMHASH]; // hashes of pages seen this pass, or 0
+  struct ksmpage page[NKSM];
+} ksm;
+
+static uint64
+ksmhash(char *pa)
+{
+  uint64 *w = (uint64*)pa, h = 14695981039346656037UL;
+
+  for(int i = 0; i < PGSIZE / sizeof(uint64); i++)
+    h = (h ^ w[i]) * 1099511628211UL;
+  return h | 1;  // never 0
+}
+
+// Drop the merged pages that no page table maps any more.
+static void
+ksmclean(void)
+{
+  struct ksmpage *k;
+
+  for(k = ksm.page; k < &ksm.page[NKSM]; k++){
+    // the kernel's direct map and the table hold two references.
+    if(k->pa && knumreference(k->pa) == 2){
+      kdereference(k->pa);
+      kfree(k->pa);
+      k->pa = 0;
+    }
+  }
+}
+
+// Map merged page pa at *pte, in place of the page it maps, whose
+// reference the caller takes over. A writable page becomes
+// copy-on-write.
+static void
+ksmmap(struct proc *p, uint64 va, pte_t *pte, char *pa)
+{
+  uint flags = PTE_FLAGS(*pte) & ~(PTE_A | PTE_D);
+
+  if(flags & PTE_W)
+    flags = (flags & ~PTE_W) | PTE_COW;
+  if(flags & PTE_COW)
+    kpageset(pa, PG_COW);
+  kreference(pa);
+  *pte = PA2PTE(pa) | flags;
+  p->asidcpu = -1;  // so uvmsatp() flushes when p next runs
+}
+
+// Look at the page p maps at va, merging it if it can be.
+// p->lock must be held.
+static void
+ksmpage(struct proc *p, uint64 va)
+{
+  pagetable_t pt;
+  pte_t *pte;
+  struct ksmpage *k, *free = 0;
+  char *pa;
+  uint64 h, *seen;
+
+  if((pt = walkpt(p->pagetable, va)) == 0)
+    return;
+  pte = &pt[PX(0, va)];
+  if((*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U))
+    return;
+  pa = (char*)PTE2PA(*pte);
+  if(knumreference(pa) != 2 || kpageflags(pa, PG_PINNED))
+    return;
+
+  h = ksmhash(pa);
+  for(k = ksm.page; k < &ksm.page[NKSM]; k++){
+    if(k->pa == 0){
+      if(free == 0)
+        free = k;
+      continue;
+    }
+    if(k->hash == h && memcmp(k->pa, pa, PGSIZE) == 0){
+      ksmmap(p, va, pte, k->pa);
+      if(kdereference(pa) != 1)
+        panic("ksmpage");
+      kfree(pa);
+      return;
+    }
+  }
+
+  seen = &ksm.seen[h % NKSMHASH];
+  if(*seen != h || free == 0){
+    *seen = h;
+    return;
+  }
+  // there may be a copy elsewhere: this page becomes the one
+  // they merge with. its copy on swap, if any, could be stale.
+  if(kswapslot(pa) >= 0){
+    swapfree(kswapslot(pa));
+    ksetswapslot(pa, -1);
+  }
+  kdereference(pa);  // the page table's, which ksmmap() adds back
+  ksmmap(p, va, pte, pa);
+  kreference(pa);    // the table's
+  free->hash = h;
+  free->pa = pa;
+}
+
+// Called by idle CPUs: scan the pages this tick's rate allows.
+void
+ksmscan(void)
+{
+  struct proc *p;
+  uint t;
+
+  if(lockfree_read4(&ksm.rate) == 0 || __sync_lock_test_and_set(&ksm.busy, 1))
+    return;
+
+  t = lockfree_read4((int*)&ticks);
+  if(t != ksm.lasttick){
+    ksm.budget = ksm.rate;
+    ksm.lasttick = t;
+  }
+  // each process visited costs one page, so that a pass over a
+  // table of idle slots ends too.
+  while(ksm.budget > 0){
+    p = &proc[ksm.hand];
+    acquire(&p->lock);
+    if(p->state == SLEEPING && p->pagetable){
+      for(; ksm.handva < p->sz && ksm.budget > 0; ksm.handva += PGSIZE, ksm.budget--)
+        ksmpage(p, ksm.handva);
+    } else {
+      ksm.handva = p->sz;
+    }
+    if(ksm.handva >= p->sz){
+      ksm.handva = 0;
+      ksm.budget--;
+      if((ksm.hand = (ksm.hand + 1) % NPROC) == 0){
+        ksmclean();
+        memset(ksm.seen, 0, sizeof(ksm.seen));
+      }
+    }
+    release(&p->lock);
+  }
+
+  __sync_lock_release(&ksm.busy);
+}
+
+// Report how many merged pages are mapped, and how many more
+// pages their mappings would take if they weren't merged.
+void
+ksmstats(uint64 *shared, uint64 *saved)
+{
+  char *pa;
+  int n;
+
+  *shared = *saved = 0;
+  for(int i = 0; i < NKSM; i++){
+    pa = (char*)lockfree_read8((uint64*)&ksm.page[i].pa);
+    if(pa && (n = knumreference(pa) - 2) > 0){
+      (*shared)++;
+      *saved += n - 1;
+    }
+  }
+}
+
+// ksm(rate): scan rate pages per clock tick; 0 stops scanning.
+// Returns the rate before.
+uint64
+sys_ksm(void)
+{
+  int rate;
+
+  argint(0, &rate);
+  if(rate < 0)
+    return -1;
+  return __sync_lock_test_and_set(&ksm.rate, rate);
+}
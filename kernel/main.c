@@ -11,6 +11,7 @@ void
 main()
 {
   if(cpuid() == 0){
+    uint64 t0, t1, t2, t3;
     consoleinit();
 #if defined(LAB_LOCK)
     statsinit();
@@ -19,9 +20,13 @@ main()
     printf("\n");
     printf("xv6 kernel is booting\n");
     printf("\n");
+    t0 = r_time();
     kinit();         // physical page allocator
+    slabinit();      // small object caches
+    t1 = r_time();
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
+    t2 = r_time();
     procinit();      // process table
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
@@ -30,12 +35,21 @@ main()
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    shminit();       // shared memory segments
+    textinit();      // program text cache
+    swapinit();      // swap
+    pipeinit();      // pipe cache
     virtio_disk_init(); // emulated hard disk
 #ifdef LAB_NET
+    mbufinit();
     pci_init();
     sockinit();
 #endif    
     userinit();      // first user process
+    t3 = r_time();
+    printf("boot: kinit %d us, kvminit %d us, devices %d us\n",
+           (t1 - t0) * 1000000 / MTIME_HZ, (t2 - t1) * 1000000 / MTIME_HZ,
+           (t3 - t2) * 1000000 / MTIME_HZ);
 #ifdef KCSAN
     kcsaninit();
 #endif
@@ -49,6 +63,7 @@ main()
     kvminithart();    // turn on paging
     trapinithart();   // install kernel trap vector
     plicinithart();   // ask PLIC for device interrupts
+    kinithart();      // bring its share of memory online
   }
 
   scheduler();        
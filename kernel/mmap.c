@@ -0,0 +1,602 @@
+// Memory-mapped files and anonymous memory.
+//
+// mmap() only records a vma in the process. Each page is read
+// in from the file, or zero-filled, by mmapfault() when it is
+// first touched. Mappings are placed top-down below MMAPTOP and
+// the heap may not grow into them.
+//
+// munmap(), exit() and exec() write the dirty pages of a
+// MAP_SHARED file mapping back to the file, never past its end.
+// fork() gives the child the same pages of a MAP_SHARED mapping
+// and copy-on-write pages of a MAP_PRIVATE one. Separate mmap()
+// calls of one file get separate pages, and see each other's
+// writes only after they have been written back. So do a parent
+// and child for the pages of a shared file mapping that neither
+// had touched at fork() (see mmapprefault()).
+//
+// shmmap() makes a MAP_SHARED mapping of a shared memory segment
+// (shm.c), whose pages are the segment's rather than new ones.
+//
+// madvise() takes hints about the heap and the mappings: to
+// drop pages, to fault them in ahead of use, or that a mapping
+// will be read in order, so that faults read ahead in the file.
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+
+#define MMAPAHEAD 8  // pages read ahead in a MADV_SEQUENTIAL mapping
+
+static struct vma*
+vmafind(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len > 0 && va >= v->addr && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+static struct vma*
+vmaalloc(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len == 0)
+      return v;
+  return 0;
+}
+
+static int
+vmaperm(struct vma *v)
+{
+  int perm = PTE_U;
+
+  if(v->prot & PROT_READ)
+    perm |= PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_R | PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  return perm;
+}
+
+// Find len bytes of free address space for a new mapping,
+// as high as possible below MMAPTOP and above the heap.
+// Returns 0 if there is no room.
+static uint64
+vmaplace(struct proc *p, uint64 len)
+{
+  struct vma *v;
+  uint64 a;
+
+  if(len > MMAPTOP)
+    return 0;
+  a = MMAPTOP - len;
+again:
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len > 0 && a < v->addr + v->len && v->addr < a + len){
+      if(v->addr < len)
+        return 0;
+      a = v->addr - len;
+      goto again;
+    }
+  }
+  // the first GB holds the kernel's device mappings too (vm.c).
+  if(a < PGROUNDUP(p->sz) || PX(2, a) == 0)
+    return 0;
+  return a;
+}
+
+// Can a new mapping go at [a, a+len)? It must lie above the
+// heap and the first GB, below MMAPTOP, and clear of p's other
+// mappings.
+static int
+vmafits(struct proc *p, uint64 a, uint64 len)
+{
+  struct vma *v;
+
+  if(a + len < a || a < PGROUNDUP(p->sz) || PX(2, a) == 0 || a + len > MMAPTOP)
+    return 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len > 0 && a < v->addr + v->len && v->addr < a + len)
+      return 0;
+  return 1;
+}
+
+// The lowest address mapped by mmap(); the heap must stay below it.
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = MMAPTOP;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len > 0 && v->addr < base)
+      base = v->addr;
+  return base;
+}
+
+// Map the page at va of mapping v, reading it in.
+// Returns 0 on success, -1 if out of memory or on error.
+static int
+vmapage(struct proc *p, struct vma *v, uint64 va)
+{
+  struct inode *ip;
+  char *mem;
+  int n;
+
+  if(v->shm){
+    if((mem = shmpage(v->shm, (v->off + (va - v->addr)) / PGSIZE)) == 0)
+      return -1;
+    return mappages(p->pagetable, va, PGSIZE, (uint64)mem, vmaperm(v));
+  }
+
+  // the part of the page past the end of the file stays zero.
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+  if(v->f){
+    ip = v->f->ip;
+    // no inode is locked here: fileread() and filewrite() fault
+    // their buffers in first.
+    ilock(ip);
+    n = readi(ip, 0, (uint64)mem, v->off + (va - v->addr), PGSIZE);
+    iunlock(ip);
+    if(n < 0){
+      kfree(mem);
+      return -1;
+    }
+  }
+
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, vmaperm(v)) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Fault in the page at va of one of p's mappings, and in a
+// MADV_SEQUENTIAL file mapping, the next few that aren't in.
+// Returns 0 on success, -1 if va is not mapped by mmap(),
+// the access is not allowed, or memory ran out.
+int
+mmapfault(struct proc *p, uint64 va, int write)
+{
+  struct vma *v;
+  uint64 a;
+  int mega;
+
+  va = PGROUNDDOWN(va);
+  if((v = vmafind(p, va)) == 0)
+    return -1;
+  if(write && (v->prot & PROT_WRITE) == 0)
+    return -1;
+  if(v->prot == PROT_NONE)
+    return -1;
+  if(vmapage(p, v, va) != 0)
+    return -1;
+
+  if(v->advice == MADV_SEQUENTIAL && v->f){
+    for(a = va + PGSIZE; a < va + (MMAPAHEAD+1)*PGSIZE && a < v->addr + v->len; a += PGSIZE){
+      if(walkleaf(p->pagetable, a, &mega) != 0)
+        break;
+      if(vmapage(p, v, a) != 0)
+        break;
+    }
+  }
+  return 0;
+}
+
+// Write the page at va, whose contents are at pa, back to v's
+// file, a few blocks per transaction as filewrite() does.
+static void
+vmawriteback(struct vma *v, uint64 va, uint64 pa)
+{
+  struct inode *ip = v->f->ip;
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint off = v->off + (va - v->addr);
+  uint i, n;
+
+  for(i = 0; i < PGSIZE; i += n){
+    n = PGSIZE - i;
+    if(n > max)
+      n = max;
+    begin_op();
+    ilock(ip);
+    if(off + i >= ip->size){
+      iunlock(ip);
+      end_op();
+      break;
+    }
+    if(n > ip->size - (off + i))
+      n = ip->size - (off + i);
+    writei(ip, 0, pa + i, off + i, n);
+    iunlock(ip);
+    end_op();
+  }
+}
+
+// Write the dirty pages of v in [start, end) back, if v is a
+// shared file mapping.
+static void
+vmasync(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  pte_t *pte;
+  uint64 va;
+  int mega;
+
+  if(v->f && (v->flags & MAP_SHARED)){
+    for(va = start; va < end; va += PGSIZE){
+      if((pte = walkleaf(p->pagetable, va, &mega)) != 0 && (*pte & PTE_D))
+        vmawriteback(v, va, PTE2PA(*pte));
+    }
+  }
+}
+
+// Remove the pages of v in [start, end) from p's page table,
+// writing dirty pages of a shared file mapping back first.
+// Returns 0 on success, -1 if a megapage or a leaf table shared
+// after fork() couldn't be split at start or end, leaving the
+// pages mapped.
+static int
+vmaunmap(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  if(uvmcut(p->pagetable, start) < 0 || uvmcut(p->pagetable, end) < 0)
+    return -1;
+  vmasync(p, v, start, end);
+  uvmunmap(p->pagetable, start, (end - start) / PGSIZE, 1);
+  return 0;
+}
+
+// Drop v's reference to its file or shared memory, and free v.
+static void
+vmafree(struct vma *v)
+{
+  if(v->f)
+    fileclose(v->f);
+  if(v->shm)
+    shmput(v->shm);
+  v->f = 0;
+  v->shm = 0;
+  v->len = 0;
+}
+
+static int
+munmap(struct proc *p, uint64 addr, uint64 len)
+{
+  struct vma *v, *nv = 0;
+  uint64 end = addr + len, start, stop, vend;
+
+  if(end < addr)
+    return -1;
+
+  // unmapping the middle of a mapping splits it in two.
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len > 0 && v->addr < addr && end < v->addr + v->len){
+      if((nv = vmaalloc(p)) == 0)
+        return -1;
+    }
+  }
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    vend = v->addr + v->len;
+    if(v->len == 0 || v == nv || vend <= addr || v->addr >= end)
+      continue;
+    start = addr > v->addr ? addr : v->addr;
+    stop = end < vend ? end : vend;
+    // the mappings before v stay removed.
+    if(vmaunmap(p, v, start, stop) < 0)
+      return -1;
+
+    if(start == v->addr && stop == vend){
+      vmafree(v);
+    } else if(start == v->addr){
+      v->off += stop - v->addr;
+      v->addr = stop;
+      v->len = vend - stop;
+    } else if(stop == vend){
+      v->len = start - v->addr;
+    } else {
+      *nv = *v;
+      nv->off += stop - v->addr;
+      nv->addr = stop;
+      nv->len = vend - stop;
+      if(nv->f)
+        filedup(nv->f);
+      if(nv->shm)
+        shmdup(nv->shm);
+      v->len = start - v->addr;
+    }
+  }
+  return 0;
+}
+
+// Remove all of p's mappings, on exit() or exec().
+void
+munmapall(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len > 0 && munmap(p, v->addr, v->len) < 0){
+      // out of memory to split the page table. the caller is
+      // about to free it, and the pages with it.
+      vmasync(p, v, v->addr, v->addr + v->len);
+      vmafree(v);
+    }
+  }
+}
+
+// Bring in the pages of p's shared mappings that a child created
+// by fork() must find in p's page table to share: the untouched
+// pages of anonymous mappings, which have no other home.
+// Untouched pages of a file are left to each process to read in,
+// at the cost that one's writes to them reach the other only
+// through the file; a shared memory segment's pages are the
+// segment's wherever they are faulted in. May sleep, so fork()
+// calls it before it allocates the child.
+int
+mmapprefault(struct proc *p)
+{
+  struct vma *v;
+  uint64 va;
+  int mega;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0 || (v->flags & MAP_SHARED) == 0 || v->prot == PROT_NONE ||
+       v->f || v->shm)
+      continue;
+    for(va = v->addr; va < v->addr + v->len; va += PGSIZE){
+      if(walkleaf(p->pagetable, va, &mega) != 0)
+        continue;
+      if(mmapfault(p, va, 0) != 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+// Give child np copies of p's mappings for fork(), sharing the
+// pages of a shared mapping that mmapprefault() left in p's page
+// table. Doesn't sleep: p still holds a reference to every file,
+// so closing np's on failure can't be the last close.
+// Returns 0 on success, -1 on failure.
+int
+mmapcopy(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->len == 0)
+      continue;
+    if(uvmcopyrange(p->pagetable, np->pagetable, v->addr, v->addr + v->len,
+                    v->flags & MAP_SHARED) != 0)
+      goto err;
+    np->vma[i] = *v;
+    if(v->f)
+      filedup(v->f);
+    if(v->shm)
+      shmdup(v->shm);
+  }
+  return 0;
+
+ err:
+  while(--i >= 0){
+    v = &np->vma[i];
+    if(v->len == 0)
+      continue;
+    uvmunmap(np->pagetable, v->addr, v->len / PGSIZE, 1);
+    if(v->f)
+      fileclose(v->f);
+    if(v->shm)
+      shmput(v->shm);
+    v->f = 0;
+    v->shm = 0;
+    v->len = 0;
+  }
+  return -1;
+}
+
+uint64
+sys_mmap(void)
+{
+  struct proc *p = myproc();
+  struct file *f = 0;
+  struct vma *v;
+  uint64 addr, len, off;
+  int prot, flags, fd;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(4, &fd);
+  argaddr(5, &off);
+
+  // addr is only a hint, and is ignored.
+  if(len == 0 || off % PGSIZE != 0)
+    return -1;
+  if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  if((flags & MAP_ANONYMOUS) == 0){
+    if(fd < 0 || fd >= NOFILE || (f = p->ofile[fd]) == 0 || f->type != FD_INODE)
+      return -1;
+    if(!f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  len = PGROUNDUP(len);
+  if((v = vmaalloc(p)) == 0 || (addr = vmaplace(p, len)) == 0)
+    return -1;
+
+  v->addr = addr;
+  v->len = len;
+  v->prot = prot;
+  v->flags = flags;
+  v->f = f ? filedup(f) : 0;
+  v->shm = 0;
+  v->off = (flags & MAP_ANONYMOUS) ? 0 : off;
+  v->advice = MADV_NORMAL;
+  return addr;
+}
+
+// Map len bytes of the shared memory segment named key at addr,
+// or wherever there is room if addr is 0. The mapping is
+// readable and writable, and munmap() removes it.
+uint64
+sys_shmmap(void)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  struct shm *s;
+  uint64 addr, len;
+  int key;
+
+  argint(0, &key);
+  argaddr(1, &len);
+  argaddr(2, &addr);
+
+  if(len == 0 || len > SHMMAXPG * PGSIZE || addr % PGSIZE != 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if((v = vmaalloc(p)) == 0)
+    return -1;
+  if(addr == 0)
+    addr = vmaplace(p, len);
+  else if(!vmafits(p, addr, len))
+    return -1;
+  if(addr == 0 || (s = shmget(key, len / PGSIZE)) == 0)
+    return -1;
+
+  v->addr = addr;
+  v->len = len;
+  v->prot = PROT_READ | PROT_WRITE;
+  v->flags = MAP_SHARED;
+  v->f = 0;
+  v->shm = s;
+  v->off = 0;
+  v->advice = MADV_NORMAL;
+  return addr;
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  if(addr % PGSIZE != 0 || len == 0)
+    return -1;
+  return munmap(myproc(), addr, PGROUNDUP(len));
+}
+
+// Fault in the pages of p in [start, end) that are on swap, in
+// the executable, or in a file or shared memory mapping, ahead
+// of use. Pages that would only be zero-filled are left alone.
+static void
+willneed(struct proc *p, uint64 start, uint64 end)
+{
+  struct vma *v;
+  uint64 va;
+  int mega, r;
+
+  for(va = start; va < end; va += PGSIZE){
+    if(walkleaf(p->pagetable, va, &mega) != 0)
+      continue;
+    if((r = swapin(p, va)) > 0)
+      r = execfault(p, va);
+    if(r < 0)
+      return;
+    if(r == 0)
+      continue;
+    if((v = vmafind(p, va)) != 0 && (v->f || v->shm) && v->prot != PROT_NONE &&
+       vmapage(p, v, va) != 0)
+      return;
+  }
+}
+
+// Act on advice about p's memory in [addr, end), which must lie
+// in the heap or in mappings. The advice about how a mapping
+// will be read applies to all of each mapping the range touches.
+// Returns 0 on success, -1 on a bad range or advice, or if
+// memory ran out to split the page table where pages are dropped.
+static int
+madvise(struct proc *p, uint64 addr, uint64 end, int advice)
+{
+  struct vma *v;
+  uint64 heapend = PGROUNDUP(p->sz), a, start, stop;
+
+  if(end < addr || end > MAXVA)
+    return -1;
+  // MADV_FREE is for private anonymous memory only. Nor can a
+  // shared anonymous mapping drop pages, which exist only in the
+  // page tables that share them.
+  for(a = addr > heapend ? addr : heapend; a < end; a = v->addr + v->len){
+    if((v = vmafind(p, a)) == 0)
+      return -1;
+    if(advice == MADV_FREE && (v->f || v->shm))
+      return -1;
+    if((advice == MADV_DONTNEED || advice == MADV_FREE) && (v->flags & MAP_SHARED) &&
+       v->f == 0 && v->shm == 0)
+      return -1;
+  }
+
+  switch(advice){
+  case MADV_NORMAL:
+  case MADV_RANDOM:
+  case MADV_SEQUENTIAL:
+    for(v = p->vma; v < &p->vma[NVMA]; v++)
+      if(v->len > 0 && v->addr < end && addr < v->addr + v->len)
+        v->advice = advice;
+    return 0;
+  case MADV_WILLNEED:
+    willneed(p, addr, end);
+    return 0;
+  case MADV_DONTNEED:
+  case MADV_FREE:
+    // the pages are given back at once: a later touch gets zeroes,
+    // or the file's contents, or a shared mapping's pages.
+    if(addr < heapend &&
+       uvmdrop(p->pagetable, addr, ((end < heapend ? end : heapend) - addr) / PGSIZE) < 0)
+      return -1;
+    for(v = p->vma; v < &p->vma[NVMA]; v++){
+      if(v->len == 0 || v->addr >= end || addr >= v->addr + v->len)
+        continue;
+      start = addr > v->addr ? addr : v->addr;
+      stop = end < v->addr + v->len ? end : v->addr + v->len;
+      if(vmaunmap(p, v, start, stop) < 0)
+        return -1;
+    }
+    return 0;
+  }
+  return -1;
+}
+
+uint64
+sys_madvise(void)
+{
+  uint64 addr, len;
+  int advice;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  argint(2, &advice);
+  if(addr % PGSIZE != 0 || len == 0)
+    return -1;
+  return madvise(myproc(), addr, addr + PGROUNDUP(len), advice);
+}
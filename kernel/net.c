@@ -61,6 +61,14 @@ mbuftrim(struct mbuf *m, unsigned int len)
   return m->head + m->len;
 }
 
+static struct kmem_cache *mbufcache;
+
+void
+mbufinit(void)
+{
+  mbufcache = kmem_cache_create("mbuf", sizeof(struct mbuf), 0);
+}
+
 // Allocates a packet buffer.
 struct mbuf *
 mbufalloc(unsigned int headroom)
@@ -69,13 +77,17 @@ mbufalloc(unsigned int headroom)
  
   if (headroom > MBUF_SIZE)
     return 0;
-  m = kalloc();
+  m = kmem_cache_alloc(mbufcache);
   if (m == 0)
     return 0;
   m->next = 0;
   m->head = (char *)m->buf + headroom;
   m->len = 0;
+#ifdef MEMDEBUG
+  // every header field and payload byte is written before
+  // it is sent, so only debug builds pay to clear the buffer.
   memset(m->buf, 0, sizeof(m->buf));
+#endif
   return m;
 }
 
@@ -83,7 +95,7 @@ mbufalloc(unsigned int headroom)
 void
 mbuffree(struct mbuf *m)
 {
-  kfree(m);
+  kmem_cache_free(mbufcache, m);
 }
 
 // Pushes an mbuf to the end of the queue.
@@ -0,0 +1,24 @@
+// Per-page metadata for physical memory managed by kalloc.c.
+// There is one struct page for each 4096-byte page between
+// KERNBASE and PHYSTOP, stored in an array just after the kernel.
+
+struct page {
+  int refcnt;   // # of page-table mappings, including the kernel's direct map
+  uint flags;   // PG_* below
+  int order;    // if PG_BUDDY, this free block is 2^order pages
+  int swapslot; // 1 + swap slot holding a copy of the page, or 0
+  int nptes;    // if a page-table page, # of its PTEs that aren't zero
+};
+
+#define PG_ZEROED (1 << 0) // contents are known to be all zeroes
+#define PG_PINNED (1 << 1) // must not be freed (e.g. in use for DMA)
+#define PG_COW    (1 << 2) // mapped copy-on-write by more than one page table
+#define PG_BUDDY  (1 << 3) // first page of a free block in the buddy allocator
+
+// kalloc_pages() hands out blocks of 2^0 .. 2^MAXORDER pages.
+#define MAXORDER  10
+#define MEGAORDER 9        // 2^9 pages make one 2 MB megapage
+
+#define NPAGES ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2IDX(pa) (((uint64) (pa) - KERNBASE) / PGSIZE)
+#define IDX2PA(i) ((void *) (KERNBASE + (uint64) (i) * PGSIZE))
@@ -1,13 +1,21 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
+#define NVMA         16  // memory mappings per process
+#define NSHM         16  // shared memory segments per system
+#define SHMMAXPG    256  // max pages in a shared memory segment
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
+#define NEXECSEG      4  // demand-paged segments per executable
+#define NTEXTPG     128  // pages in the program text cache
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
+#define NSWAPPG      4096  // pages of swap, on disk after the file system
+#define NZPAGE       8192  // pages of swap kept compressed in memory
+#define NKSM          256  // pages shared by same-page merging
 #define MAXPATH      128   // maximum file path name
@@ -7,6 +7,7 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "uaccess.h"
 
 #define PIPESIZE 512
 
@@ -19,6 +20,20 @@ struct pipe {
   int writeopen;  // write fd is still open
 };
 
+static struct kmem_cache *pipecache;
+
+static void
+pipector(void *p)
+{
+  initlock(&((struct pipe*)p)->lock, "pipe");
+}
+
+void
+pipeinit(void)
+{
+  pipecache = kmem_cache_create("pipe", sizeof(struct pipe), pipector);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,13 +43,12 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = (struct pipe*)kmem_cache_alloc(pipecache)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
-  initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
   (*f0)->writable = 0;
@@ -47,7 +61,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    kmem_cache_free(pipecache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,7 +82,7 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    kmem_cache_free(pipecache, pi);
   } else
     release(&pi->lock);
 }
@@ -76,9 +90,15 @@ pipeclose(struct pipe *pi, int writable)
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
-  int i = 0;
+  int i = 0, m;
   struct proc *pr = myproc();
+  struct uaccess ua;
 
+  // copies are made with pi->lock held, so fault in what the
+  // next ones need first, and again after each sleep.
+  if(uaccess_touch(addr, n < PIPESIZE ? n : PIPESIZE, 0) < 0)
+    return -1;
+  uaccess_init(&ua, pr->pagetable);
   acquire(&pi->lock);
   while(i < n){
     if(pi->readopen == 0 || killed(pr)){
@@ -88,12 +108,22 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
     if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
       wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
+      release(&pi->lock);
+      if(uaccess_touch(addr + i, n - i < PIPESIZE ? n - i : PIPESIZE, 0) < 0)
+        return i;
+      acquire(&pi->lock);
+      uaccess_init(&ua, pr->pagetable);
     } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+      // as much as fits, up to the end of the buffer.
+      m = n - i;
+      if(m > pi->nread + PIPESIZE - pi->nwrite)
+        m = pi->nread + PIPESIZE - pi->nwrite;
+      if(m > PIPESIZE - pi->nwrite % PIPESIZE)
+        m = PIPESIZE - pi->nwrite % PIPESIZE;
+      if(uaccess_copyin(&ua, &pi->data[pi->nwrite % PIPESIZE], addr + i, m) == -1)
         break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      pi->nwrite += m;
+      i += m;
     }
   }
   wakeup(&pi->nread);
@@ -105,10 +135,13 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
+  int i, m;
   struct proc *pr = myproc();
-  char ch;
+  struct uaccess ua;
 
+  // the copy is made with pi->lock held.
+  if(uaccess_touch(addr, n < PIPESIZE ? n : PIPESIZE, 1) < 0)
+    return -1;
   acquire(&pi->lock);
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
     if(killed(pr)){
@@ -116,13 +149,24 @@ piperead(struct pipe *pi, uint64 addr, int n)
       return -1;
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
+    release(&pi->lock);
+    if(uaccess_touch(addr, n < PIPESIZE ? n : PIPESIZE, 1) < 0)
+      return -1;
+    acquire(&pi->lock);
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
+  uaccess_init(&ua, pr->pagetable);
+  for(i = 0; i < n; i += m){  //DOC: piperead-copy
     if(pi->nread == pi->nwrite)
       break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    // as much as there is, up to the end of the buffer.
+    m = n - i;
+    if(m > pi->nwrite - pi->nread)
+      m = pi->nwrite - pi->nread;
+    if(m > PIPESIZE - pi->nread % PIPESIZE)
+      m = PIPESIZE - pi->nread % PIPESIZE;
+    if(uaccess_copyout(&ua, addr + i, &pi->data[pi->nread % PIPESIZE], m) == -1)
       break;
+    pi->nread += m;
   }
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   release(&pi->lock);
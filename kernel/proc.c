@@ -5,6 +5,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "spawn.h"
 
 struct cpu cpus[NCPU];
 
@@ -15,10 +16,16 @@ struct proc *initproc;
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// Number of processes in each state, kept up to date by
+// setstate() so that sysinfo can read them without scanning
+// proc[] and taking every p->lock.
+static int nstate[ZOMBIE+1];
+
 extern void forkret(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
+extern pagetable_t kernel_pagetable; // vm.c
 
 // helps ensure that wakeups of wait()ing
 // parents are not lost. helps obey the
@@ -43,6 +50,16 @@ proc_mapstacks(pagetable_t kpgtbl)
   }
 }
 
+// Move p to state s, updating the per-state counts.
+// p->lock must be held.
+static void
+setstate(struct proc *p, enum procstate s)
+{
+  __sync_fetch_and_sub(&nstate[p->state], 1);
+  __sync_fetch_and_add(&nstate[s], 1);
+  p->state = s;
+}
+
 // initialize the proc table.
 void
 procinit(void)
@@ -54,6 +71,7 @@ procinit(void)
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->state = UNUSED;
+      nstate[UNUSED]++;
       p->kstack = KSTACK((int) (p - proc));
   }
 }
@@ -123,7 +141,15 @@ allocproc(void)
 
 found:
   p->pid = allocpid();
-  p->state = USED;
+  setstate(p, USED);
+  p->asid = 0;
+  p->asidcpu = -1;
+  p->cowlast = -1;
+  p->cowfaults = 0;
+  p->cowcopies = 0;
+  p->exe = 0;
+  p->nseg = 0;
+  p->guard = 0;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -140,6 +166,14 @@ found:
     return 0;
   }
 
+  // A kernel page table that reaches the user memory.
+  p->kpagetable = kvmcreate(p->pagetable);
+  if(p->kpagetable == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+
   // Set up new context to start executing at forkret,
   // which returns to user space.
   memset(&p->context, 0, sizeof(p->context));
@@ -155,6 +189,9 @@ found:
 static void
 freeproc(struct proc *p)
 {
+  if(p->kpagetable)
+    kfree((void*)p->kpagetable);
+  p->kpagetable = 0;
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
@@ -168,7 +205,7 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
-  p->state = UNUSED;
+  setstate(p, UNUSED);
 }
 
 // Create a user page table for a given process, with no user memory,
@@ -183,12 +220,20 @@ proc_pagetable(struct proc *p)
   if(pagetable == 0)
     return 0;
 
+  // the kernel's own mappings in the first GB, for the
+  // process's kernel page table (see kvmcreate()).
+  if(uvmkmap(pagetable) < 0){
+    uvmfree(pagetable, 0);
+    return 0;
+  }
+
   // map the trampoline code (for system call return)
   // at the highest user virtual address.
   // only the supervisor uses it, on the way
   // to/from user space, so not PTE_U.
   if(mappages(pagetable, TRAMPOLINE, PGSIZE,
               (uint64)trampoline, PTE_R | PTE_X) < 0){
+    uvmkunmap(pagetable);
     uvmfree(pagetable, 0);
     return 0;
   }
@@ -198,6 +243,7 @@ proc_pagetable(struct proc *p)
   if(mappages(pagetable, TRAPFRAME, PGSIZE,
               (uint64)(p->trapframe), PTE_R | PTE_W) < 0){
     uvmunmap(pagetable, TRAMPOLINE, 1, 0);
+    uvmkunmap(pagetable);
     uvmfree(pagetable, 0);
     return 0;
   }
@@ -207,6 +253,7 @@ proc_pagetable(struct proc *p)
   if (sys_frame == 0) {
     uvmunmap(pagetable, TRAMPOLINE, 1, 0);
     uvmunmap(pagetable, TRAPFRAME, 1, 0);
+    uvmkunmap(pagetable);
     uvmfree(pagetable, 0);
     return 0;
   }
@@ -215,6 +262,7 @@ proc_pagetable(struct proc *p)
   if (mappages(pagetable, USYSCALL, PGSIZE, (uint64)sys_frame, PTE_R | PTE_U) < 0) {
     uvmunmap(pagetable, TRAMPOLINE, 1, 0);
     uvmunmap(pagetable, TRAPFRAME, 1, 0);
+    uvmkunmap(pagetable);
     uvmfree(pagetable, 0);
     kfree(sys_frame);
     return 0;
@@ -231,6 +279,7 @@ proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
   uvmunmap(pagetable, TRAPFRAME, 1, 0);
+  uvmkunmap(pagetable);
 #ifdef LAB_PGTBL
   pte_t *pte = walk(pagetable, USYSCALL, 0);
   uint64 pa = PTE2PA(*pte);
@@ -274,12 +323,15 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setstate(p, RUNNABLE);
 
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only allocates page-table pages; usertrap() allocates
+// each page when it is first touched. It still fails if there
+// is not enough free memory to back the new pages right now.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
@@ -289,11 +341,22 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    // the kernel reaches user memory only below PLIC.
+    if(sz + n < sz || sz + n > mmapbase(p) || sz + n > PLIC)
+      return -1;
+    if(PGROUNDUP(sz + n) - PGROUNDUP(sz) > free_physical_memory() + swapspace())
+      return -1;
+    if(uvmreserve(p->pagetable, sz, sz + n) != 0){
+      // free the page-table pages it did get.
+      uvmunmap(p->pagetable, PGROUNDUP(sz), (PGROUNDUP(sz + n) - PGROUNDUP(sz)) / PGSIZE, 1);
       return -1;
     }
+    sz += n;
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    // fails if a megapage must be split and memory is short.
+    if((sz = uvmdealloc(p->pagetable, sz, sz + n)) != p->sz + n)
+      return -1;
+    exectrim(p, sz);
   }
   p->sz = sz;
   return 0;
@@ -308,6 +371,11 @@ fork(void)
   struct proc *np;
   struct proc *p = myproc();
 
+  // Shared pages must be in the page table to be shared.
+  if(mmapprefault(p) < 0){
+    return -1;
+  }
+
   // Allocate process.
   if((np = allocproc()) == 0){
     return -1;
@@ -324,6 +392,12 @@ fork(void)
   }
   np->sz = p->sz;
 
+  if(mmapcopy(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
 
@@ -336,6 +410,9 @@ fork(void)
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
 
+  // the child reads the pages the parent hasn't from the same file.
+  execdup(np, p);
+
   safestrcpy(np->name, p->name, sizeof(p->name));
 
   pid = np->pid;
@@ -347,7 +424,134 @@ fork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setstate(np, RUNNABLE);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Apply spawn() file actions fa[0..n-1] to np's open files.
+// Returns 0 on success, -1 if one is bad.
+static int
+spawnfiles(struct proc *np, struct spawnfa *fa, int n)
+{
+  int i, fd;
+
+  for(i = 0; i < n; i++){
+    fd = fa[i].fd;
+    if(fd < 0 || fd >= NOFILE)
+      return -1;
+    switch(fa[i].type){
+    case SPAWN_DUP2:
+      if(np->ofile[fd] == 0 || fa[i].newfd < 0 || fa[i].newfd >= NOFILE)
+        return -1;
+      if(fa[i].newfd == fd)
+        break;
+      if(np->ofile[fa[i].newfd])
+        fileclose(np->ofile[fa[i].newfd]);
+      np->ofile[fa[i].newfd] = filedup(np->ofile[fd]);
+      break;
+    case SPAWN_CLOSE:
+      if(np->ofile[fd] == 0)
+        return -1;
+      fileclose(np->ofile[fd]);
+      np->ofile[fd] = 0;
+      break;
+    case SPAWN_CLOSEFROM:
+      for(; fd < NOFILE; fd++){
+        if(np->ofile[fd]){
+          fileclose(np->ofile[fd]);
+          np->ofile[fd] = 0;
+        }
+      }
+      break;
+    default:
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Create a new process running the program at path with
+// arguments argv. Unlike fork() then exec(), nothing of the
+// caller's memory is copied: the child's is loaded straight
+// from the ELF file. The child starts with the caller's open
+// files, then applies the n file actions in fa.
+// Returns the child's pid, or -1 on failure.
+int
+spawn(char *path, char **argv, struct spawnfa *fa, int n)
+{
+  int i, pid, argc;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct execimage im;
+  pagetable_t oldpagetable;
+
+  // Allocate process.
+  if((np = allocproc()) == 0){
+    return -1;
+  }
+  // loading the program sleeps. np isn't RUNNABLE, so nothing
+  // else will touch it meanwhile.
+  release(&np->lock);
+
+  if((argc = execload(np, path, argv, &im)) < 0){
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  // replace allocproc()'s empty page table.
+  oldpagetable = np->pagetable;
+  np->pagetable = im.pagetable;
+  kvmuser(np);
+  proc_freepagetable(oldpagetable, 0);
+  np->sz = im.sz;
+  np->exe = im.ip;
+  np->nseg = im.nseg;
+  memmove(np->seg, im.seg, sizeof(im.seg));
+  np->guard = im.guard;
+  safestrcpy(np->name, im.name, sizeof(np->name));
+
+  // start at main(argc, argv).
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+  np->trapframe->epc = im.entry;
+  np->trapframe->sp = im.sp;
+  np->trapframe->a0 = argc;
+  np->trapframe->a1 = im.sp;
+
+  for(i = 0; i < NOFILE; i++)
+    if(p->ofile[i])
+      np->ofile[i] = filedup(p->ofile[i]);
+  np->cwd = idup(p->cwd);
+  np->tracemask = p->tracemask;
+
+  if(spawnfiles(np, fa, n) < 0){
+    for(i = 0; i < NOFILE; i++){
+      if(np->ofile[i]){
+        fileclose(np->ofile[i]);
+        np->ofile[i] = 0;
+      }
+    }
+    begin_op();
+    iput(np->cwd);
+    end_op();
+    np->cwd = 0;
+    execput(np);
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
+  pid = np->pid;
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  setstate(np, RUNNABLE);
   release(&np->lock);
 
   return pid;
@@ -385,6 +589,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Write back and remove memory mappings.
+  munmapall(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -394,6 +601,8 @@ exit(int status)
     }
   }
 
+  execput(p);
+
   begin_op();
   iput(p->cwd);
   end_op();
@@ -410,7 +619,7 @@ exit(int status)
   acquire(&p->lock);
 
   p->xstate = status;
-  p->state = ZOMBIE;
+  setstate(p, ZOMBIE);
 
   release(&wait_lock);
 
@@ -428,6 +637,9 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the copyout below is made with locks held.
+  if(addr != 0 && uaccess_touch(addr, sizeof(pp->xstate), 1) < 0)
+    return -1;
   acquire(&wait_lock);
 
   for(;;){
@@ -465,6 +677,12 @@ wait(uint64 addr)
     
     // Wait for a child to exit.
     sleep(p, &wait_lock);  //DOC: wait-sleep
+    if(addr != 0){
+      release(&wait_lock);
+      if(uaccess_touch(addr, sizeof(pp->xstate), 1) < 0)
+        return -1;
+      acquire(&wait_lock);
+    }
   }
 }
 
@@ -480,28 +698,50 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int found = 1;
+  uint64 now, last = r_time();
   
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
+    // charge the previous pass to idle time if it
+    // found nothing to run.
+    now = r_time();
+    if(found == 0)
+      c->idle += now - last;
+    last = now;
+
+    found = 0;
     for(p = proc; p < &proc[NPROC]; p++) {
       acquire(&p->lock);
       if(p->state == RUNNABLE) {
+        found = 1;
         // Switch to chosen process.  It is the process's job
         // to release its lock and then reacquire it
         // before jumping back to us.
-        p->state = RUNNING;
+        setstate(p, RUNNING);
         c->proc = p;
+        kvmswitch(p->kpagetable);
         swtch(&c->context, &p->context);
 
         // Process is done running for now.
         // It should have changed its p->state before coming back.
+        // Leave its kernel page table before wait() can free it.
+        kvmswitch(kernel_pagetable);
         c->proc = 0;
       }
       release(&p->lock);
     }
+
+    // Nothing to run: spend the idle time bringing memory
+    // online, then zeroing pages for kalloc_zeroed() and
+    // merging identical pages.
+    if(found == 0 && kgrow() == 0){
+      kzero_fill(8);
+      ksmscan();
+    }
   }
 }
 
@@ -538,7 +778,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setstate(p, RUNNABLE);
   sched();
   release(&p->lock);
 }
@@ -583,7 +823,7 @@ sleep(void *chan, struct spinlock *lk)
 
   // Go to sleep.
   p->chan = chan;
-  p->state = SLEEPING;
+  setstate(p, SLEEPING);
 
   sched();
 
@@ -606,7 +846,7 @@ wakeup(void *chan)
     if(p != myproc()){
       acquire(&p->lock);
       if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
+        setstate(p, RUNNABLE);
       }
       release(&p->lock);
     }
@@ -627,7 +867,7 @@ kill(int pid)
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        setstate(p, RUNNABLE);
       }
       release(&p->lock);
       return 0;
@@ -659,17 +899,14 @@ killed(struct proc *p)
 uint64
 num_procs(void)
 {
-  struct proc *p;
-  uint64 count = 0;
-  for (int i = 0; i < NPROC; i++) {
-    p = &proc[i];
-    acquire(&p->lock);
-    if (p->state != UNUSED) {
-      ++count;
-    }
-    release(&p->lock);
-  }
-  return count;
+  return NPROC - lockfree_read4(&nstate[UNUSED]);
+}
+
+// Number of processes in the given state.
+uint64
+num_procs_state(int state)
+{
+  return lockfree_read4(&nstate[state]);
 }
 
 // Copy to either a user address, or kernel address,
@@ -24,6 +24,8 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 idle;                // time CSR ticks spent with nothing to run.
+  uint64 asidgen;             // ASID generation this hart's TLB was flushed for.
 };
 
 extern struct cpu cpus[NCPU];
@@ -79,6 +81,41 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A memory mapping made by mmap(). Free if len is 0.
+struct vma {
+  uint64 addr;                 // page-aligned start
+  uint64 len;                  // page-aligned length
+  int prot;                    // PROT_READ, PROT_WRITE, PROT_EXEC
+  int flags;                   // MAP_SHARED or MAP_PRIVATE, MAP_ANONYMOUS
+  struct file *f;              // mapped file, 0 if anonymous
+  struct shm *shm;             // mapped shared memory segment, or 0
+  uint64 off;                  // file or segment offset of addr
+  int advice;                  // MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL
+};
+
+// A loadable segment of a process's executable, whose pages
+// are read in from the file when first touched (exec.c).
+struct execseg {
+  uint64 va;                   // page-aligned start
+  uint64 memsz;                // bytes of memory
+  uint64 filesz;               // bytes from the file; the rest is zero
+  uint64 off;                  // file offset of va
+  int perm;                    // PTE_W, PTE_X
+};
+
+// A program set up by execload(), ready to replace a process's.
+struct execimage {
+  pagetable_t pagetable;
+  uint64 sz;
+  uint64 entry;                // initial program counter
+  uint64 sp;                   // initial stack pointer, also argv
+  uint64 guard;                // stack guard page
+  char name[16];
+  struct inode *ip;            // the executable, with a reference
+  int nseg;
+  struct execseg seg[NEXECSEG];
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -99,6 +136,9 @@ struct proc {
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
+  pagetable_t kpagetable;      // Kernel page table, sharing pagetable's first GB
+  uint64 asid;                 // ASID generation and ASID of pagetable
+  int asidcpu;                 // hart that last ran pagetable
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
@@ -111,4 +151,12 @@ struct proc {
   uint64 alarm_handler;
   int alarm_executing;
   struct trapframe alarmframe; // the trapframe at the time alarm handler is called
+  struct vma vma[NVMA];        // mmap() regions
+  struct inode *exe;           // executable, for demand paging
+  int nseg;                    // loadable segments of exe
+  struct execseg seg[NEXECSEG];
+  uint64 guard;                // stack guard page, which udirect() avoids
+  uint64 cowlast;              // page of the last copy-on-write fault
+  int cowfaults;               // # of copy-on-write faults
+  int cowcopies;               // # of pages they copied
 };
@@ -0,0 +1,129 @@
+// Shared memory segments.
+//
+// shmmap() maps the segment named by a key into the caller as a
+// MAP_SHARED mapping (see mmap.c), creating the segment, zero
+// filled, if no process has it mapped. Every process that maps
+// a key sees the same physical pages, so data written by one is
+// read by the others without any copying.
+//
+// A segment holds a reference to each of its pages, on top of
+// the references of the page tables that map them, so the pages
+// outlive any one mapping. Each vma that maps a segment holds a
+// reference to it; fork() shares the pages and duplicates the
+// vma, and the segment is freed when its last vma is unmapped,
+// whether by munmap(), exec() or exit().
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+
+struct shm {
+  int key;
+  int ref;                    // vmas that map it; free if 0
+  int npage;
+  char *page[SHMMAXPG];
+};
+
+static struct spinlock shmlock;
+static struct shm shm[NSHM];
+
+void
+shminit(void)
+{
+  initlock(&shmlock, "shm");
+}
+
+// Drop the segment's own reference to its first n pages,
+// freeing those no longer mapped anywhere.
+static void
+shmfree(struct shm *s, int n)
+{
+  for(int i = 0; i < n; i++){
+    if(kdereference(s->page[i]) == 1)
+      kfree(s->page[i]);
+    s->page[i] = 0;
+  }
+  s->npage = 0;
+}
+
+// Return the segment named key with a new reference, creating
+// it with npage zeroed pages if it doesn't exist. Returns 0 if
+// an existing segment is smaller than npage, or if there is no
+// free segment or memory.
+struct shm*
+shmget(int key, int npage)
+{
+  struct shm *s, *free = 0;
+  int i;
+
+  if(npage <= 0 || npage > SHMMAXPG)
+    return 0;
+
+  acquire(&shmlock);
+  for(s = shm; s < &shm[NSHM]; s++){
+    if(s->ref > 0 && s->key == key){
+      if(npage > s->npage){
+        release(&shmlock);
+        return 0;
+      }
+      s->ref++;
+      release(&shmlock);
+      return s;
+    }
+    if(s->ref == 0 && free == 0)
+      free = s;
+  }
+  if((s = free) == 0){
+    release(&shmlock);
+    return 0;
+  }
+  for(i = 0; i < npage; i++){
+    if((s->page[i] = kalloc_zeroed()) == 0){
+      shmfree(s, i);
+      release(&shmlock);
+      return 0;
+    }
+    kreference(s->page[i]);
+  }
+  s->key = key;
+  s->npage = npage;
+  s->ref = 1;
+  release(&shmlock);
+  return s;
+}
+
+// Add a reference to s, for a vma copied by fork() or split
+// by munmap().
+void
+shmdup(struct shm *s)
+{
+  acquire(&shmlock);
+  if(s->ref < 1)
+    panic("shmdup");
+  s->ref++;
+  release(&shmlock);
+}
+
+// Drop a reference to s; the last one frees the segment. Its
+// pages must already be unmapped from the caller's vma.
+void
+shmput(struct shm *s)
+{
+  acquire(&shmlock);
+  if(s->ref < 1)
+    panic("shmput");
+  if(--s->ref == 0)
+    shmfree(s, s->npage);
+  release(&shmlock);
+}
+
+// Return the kernel address of page i of s, or 0 if s is smaller.
+char*
+shmpage(struct shm *s, uint64 i)
+{
+  if(i >= s->npage)
+    return 0;
+  return s->page[i];
+}
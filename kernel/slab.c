@@ -0,0 +1,309 @@
+// Slab allocator for small kernel objects.
+//
+// A cache hands out objects of one size. Objects are carved out
+// of slabs, blocks of 2^order pages from kalloc_pages(); since a
+// block is aligned to its size, an object's slab header is found
+// by rounding the object's address down.
+//
+// Each CPU keeps a magazine of free objects per cache. Allocating
+// and freeing only touch this CPU's magazine with interrupts off,
+// and take the cache lock only to move half a magazine to or from
+// the slabs when the magazine runs empty or full.
+//
+// Interface:
+// * kmem_cache_create() makes a cache; call it while booting.
+// * kmem_cache_alloc() returns a constructed object, or 0.
+// * kmem_cache_free() gives an object back. It must be returned
+//     in its constructed state (e.g. with its locks released),
+//     since the constructor runs only when a slab is created.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "page.h"
+
+#define NCACHE  16  // maximum number of caches
+#define MAGSIZE 16  // objects per per-CPU magazine
+
+struct slab {
+  struct slab *next;    // on the cache's partial, full or empty list
+  struct slab *prev;
+  void *freelist;       // free objects in this slab
+  int inuse;            // # of objects handed out
+};
+
+// Free objects on a CPU's magazine. Only touched by its own CPU
+// with interrupts off, so it needs no lock.
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+  char *name;
+  uint size;            // bytes per object, including the free link
+  int order;            // each slab is 2^order pages
+  int perslab;          // objects per slab
+  void (*ctor)(void *);
+
+  struct spinlock lock; // protects the slab lists and counts
+  struct slab partial;  // list heads
+  struct slab full;
+  struct slab empty;
+  int nslab;
+  int nobj;             // objects handed out of slabs, incl. magazines
+
+  struct magazine mag[NCPU];
+};
+
+struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NCACHE];
+  int n;
+} slabs;
+
+// The free-list link of a free object lives in its last word,
+// leaving the constructed part of the object untouched.
+#define SLABHDR ((sizeof(struct slab) + 7) & ~7)
+#define FREELINK(c, obj) (*(void **)((char *)(obj) + (c)->size - sizeof(void *)))
+#define OBJ2SLAB(c, obj) ((struct slab *)((uint64)(obj) & ~((PGSIZE << (c)->order) - 1)))
+
+void
+slabinit(void)
+{
+  initlock(&slabs.lock, "slabs");
+}
+
+static void
+slist_init(struct slab *h)
+{
+  h->next = h->prev = h;
+}
+
+static void
+slist_remove(struct slab *s)
+{
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+}
+
+static void
+slist_push(struct slab *h, struct slab *s)
+{
+  s->next = h->next;
+  s->prev = h;
+  h->next->prev = s;
+  h->next = s;
+}
+
+// Create a cache of size-byte objects. ctor, if not 0, is run
+// on every object when its slab is created. Panics if the
+// object size is too large or there are too many caches.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size, void (*ctor)(void *))
+{
+  struct kmem_cache *c;
+  uint avail;
+  int order;
+
+  size = ((size + 7) & ~7) + sizeof(void *);
+
+  // the smallest slab that wastes no more than 1/8 of itself.
+  for(order = 0; order <= MAXORDER; order++){
+    avail = (PGSIZE << order) - SLABHDR;
+    if(avail >= size && (avail % size) * 8 <= (PGSIZE << order))
+      break;
+  }
+  if(order > MAXORDER)
+    panic("kmem_cache_create: size");
+
+  acquire(&slabs.lock);
+  if(slabs.n == NCACHE)
+    panic("kmem_cache_create: too many");
+  c = &slabs.cache[slabs.n++];
+  release(&slabs.lock);
+
+  c->name = name;
+  c->size = size;
+  c->order = order;
+  c->perslab = avail / size;
+  c->ctor = ctor;
+  initlock(&c->lock, "slab");
+  slist_init(&c->partial);
+  slist_init(&c->full);
+  slist_init(&c->empty);
+  return c;
+}
+
+// Allocate and construct a new slab for c and put it on the
+// empty list. Returns 0 if out of memory.
+static int
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *obj;
+
+  if((s = kalloc_pages(c->order)) == 0)
+    return 0;
+  s->freelist = 0;
+  s->inuse = 0;
+  obj = (char *)s + SLABHDR;
+  for(int i = 0; i < c->perslab; i++, obj += c->size){
+    if(c->ctor)
+      c->ctor(obj);
+    FREELINK(c, obj) = s->freelist;
+    s->freelist = obj;
+  }
+
+  acquire(&c->lock);
+  slist_push(&c->empty, s);
+  c->nslab++;
+  release(&c->lock);
+  return 1;
+}
+
+// Take one object out of c's slabs. c->lock must be held.
+// Returns 0 if every slab is full.
+static void *
+slab_take(struct kmem_cache *c)
+{
+  struct slab *s;
+  void *obj;
+
+  if(c->partial.next != &c->partial)
+    s = c->partial.next;
+  else if(c->empty.next != &c->empty)
+    s = c->empty.next;
+  else
+    return 0;
+
+  obj = s->freelist;
+  s->freelist = FREELINK(c, obj);
+  s->inuse++;
+  c->nobj++;
+  slist_remove(s);
+  slist_push(s->inuse == c->perslab ? &c->full : &c->partial, s);
+  return obj;
+}
+
+// Return obj to its slab. c->lock must be held.
+// Returns the slab if it became empty and c already has
+// another empty slab, so the caller can free it.
+static struct slab *
+slab_put(struct kmem_cache *c, void *obj)
+{
+  struct slab *s = OBJ2SLAB(c, obj);
+
+  FREELINK(c, obj) = s->freelist;
+  s->freelist = obj;
+  s->inuse--;
+  c->nobj--;
+  slist_remove(s);
+  if(s->inuse > 0){
+    slist_push(&c->partial, s);
+    return 0;
+  }
+  if(c->empty.next == &c->empty){
+    slist_push(&c->empty, s);
+    return 0;
+  }
+  c->nslab--;
+  return s;
+}
+
+// Fill this CPU's empty magazine halfway from the slabs.
+static void
+mag_refill(struct kmem_cache *c, struct magazine *m)
+{
+  void *obj;
+
+  acquire(&c->lock);
+  while(m->n < MAGSIZE / 2){
+    if((obj = slab_take(c)) == 0){
+      release(&c->lock);
+      if(slab_grow(c) == 0)
+        return;
+      acquire(&c->lock);
+      continue;
+    }
+    m->obj[m->n++] = obj;
+  }
+  release(&c->lock);
+}
+
+// Move half of this CPU's full magazine back to the slabs.
+static void
+mag_flush(struct kmem_cache *c, struct magazine *m)
+{
+  struct slab *s, *dead[MAGSIZE / 2];
+  int ndead = 0;
+
+  acquire(&c->lock);
+  while(m->n > MAGSIZE / 2){
+    if((s = slab_put(c, m->obj[--m->n])) != 0)
+      dead[ndead++] = s;
+  }
+  release(&c->lock);
+
+  while(ndead > 0)
+    kfree_pages(dead[--ndead], c->order);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *obj;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0)
+    mag_refill(c, m);
+  obj = 0;
+  if(m->n > 0)
+    obj = m->obj[--m->n];
+  pop_off();
+  return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+
+  if(OBJ2SLAB(c, obj) == (struct slab *)obj ||
+     ((char *)obj - (char *)OBJ2SLAB(c, obj) - SLABHDR) % c->size != 0)
+    panic("kmem_cache_free");
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE)
+    mag_flush(c, m);
+  m->obj[m->n++] = obj;
+  pop_off();
+}
+
+// Print every cache's size and slab usage.
+// Runs when user types ^F on console, after kmemdump().
+void
+slabdump(void)
+{
+  struct kmem_cache *c;
+  int n, nslab, nobj, cached;
+
+  n = lockfree_read4(&slabs.n);
+  for(c = slabs.cache; c < &slabs.cache[n]; c++){
+    acquire(&c->lock);
+    nslab = c->nslab;
+    nobj = c->nobj;
+    release(&c->lock);
+    cached = 0;
+    for(int i = 0; i < NCPU; i++)
+      cached += lockfree_read4(&c->mag[i].n);
+    printf("slab %s: %d bytes, %d per %d KB slab, %d slabs, %d in use, %d cached\n",
+           c->name, c->size, c->perslab, 4 << c->order, nslab, nobj - cached, cached);
+  }
+}
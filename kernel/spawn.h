@@ -0,0 +1,15 @@
+// File actions for spawn(). The new process starts with the
+// caller's open files, then applies the actions in order.
+// A list of them ends with one of type SPAWN_END.
+#define SPAWN_END       0
+#define SPAWN_DUP2      1  // make newfd refer to fd's file
+#define SPAWN_CLOSE     2  // close fd
+#define SPAWN_CLOSEFROM 3  // close fd and every fd above it
+
+#define MAXSPAWNFA 16      // max # of actions
+
+struct spawnfa {
+  int type;
+  int fd;
+  int newfd;
+};
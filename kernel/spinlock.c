@@ -158,6 +158,19 @@ pop_off(void)
     intr_on();
 }
 
+// Is this cpu holding a spinlock, or otherwise between push_off()
+// and pop_off(), where sleep() would panic?
+int
+holdingspin(void)
+{
+  int r;
+
+  push_off();
+  r = mycpu()->noff > 1;
+  pop_off();
+  return r;
+}
+
 // Read a shared 64-bit value without holding a lock
 uint64
 lockfree_read8(uint64 *addr) {
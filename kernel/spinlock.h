@@ -5,5 +5,9 @@ struct spinlock {
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
+#ifdef LAB_LOCK
+  int nts;           // # of test-and-set spins while acquiring
+  int n;             // # of acquire() calls
+#endif
 };
 
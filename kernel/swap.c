@@ -0,0 +1,371 @@
+// Swap.
+//
+// When free memory runs low, swapreclaim() pages user memory out
+// to the swap area, blocks on the disk after the file system
+// (see mkfs), one page-sized slot per page. A page on swap
+// leaves behind a PTE without PTE_V, with PTE_SWAP set and the
+// slot where the page number was; its other flags stay, so that
+// swapin(), called from the page fault handlers when the process
+// next touches the page, maps it back the way it was.
+//
+// Pages are chosen by a clock algorithm. A hand sweeps over the
+// processes' memory, clearing PTE_A on pages used since it last
+// came round, and pages out the first page it finds that hasn't
+// been. Only pages that just one page table maps, in a leaf
+// table of its own, are taken: a page that fork() shares
+// copy-on-write stays in memory until the sharing is resolved,
+// and so do megapages and mmap() regions. The process must be
+// asleep, or be the one short of memory, so that nothing changes
+// its page table while the hand looks at it.
+//
+// A page that compresses to half its size or less is kept
+// compressed in memory (zram.c) instead; its swap PTE holds a
+// slot number from ZSLOT up, one for each compressed entry.
+//
+// A slot has a reference for each swap PTE that holds it, and
+// one if it holds a copy of a page in memory. A page read back
+// in from disk keeps its slot, so if it is chosen again before
+// it has been written (PTE_D is still clear), it needn't be
+// written out again. One read back from a compressed entry
+// drops it, since it would only take up memory.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "buf.h"
+#include "defs.h"
+#include "page.h"
+
+// reclaim when fewer than SWAPLOW pages are free, SWAPBATCH
+// pages at a time.
+#define SWAPLOW   256
+#define SWAPBATCH 32
+
+// slot numbers from ZSLOT up are compressed entries.
+#define ZSLOT NSWAPPG
+
+extern struct proc proc[NPROC];
+extern struct superblock sb;
+
+static struct spinlock slotlock;
+static ushort slotref[NSWAPPG];   // references to each slot; free if 0
+static int slotnext;              // where to look for a free slot
+static int nslotused;
+
+// the buffer for swap I/O.
+static struct sleeplock iolock;
+static struct buf iobuf;
+
+// the clock hand: swapout() holds swaplock while it moves it.
+static struct sleeplock swaplock;
+static int hand;          // process being swept
+static uint64 handva;     // next address in it
+
+// swapin()s from compressed entries and from disk, and the time
+// they took, in r_time() units.
+static uint64 nzfault, zfaulttime;
+static uint64 ndiskfault, diskfaulttime;
+
+void
+swapinit(void)
+{
+  initlock(&slotlock, "swapslot");
+  initsleeplock(&iolock, "swapio");
+  initsleeplock(&swaplock, "swap");
+  zraminit();
+}
+
+// Number of slots, 0 until the file system is up.
+static int
+nslot(void)
+{
+  return sb.nswap < NSWAPPG ? sb.nswap : NSWAPPG;
+}
+
+// Allocate a slot, with one reference. Returns -1 if swap is full.
+static int
+swapalloc(void)
+{
+  int s, n = nslot();
+
+  acquire(&slotlock);
+  for(int i = 0; i < n; i++){
+    s = (slotnext + i) % n;
+    if(slotref[s] == 0){
+      slotref[s] = 1;
+      slotnext = (s + 1) % n;
+      nslotused++;
+      release(&slotlock);
+      return s;
+    }
+  }
+  release(&slotlock);
+  return -1;
+}
+
+// Add a reference to slot s, for a swap PTE copied by fork().
+void
+swapdup(int s)
+{
+  if(s >= ZSLOT){
+    zramdup(s - ZSLOT);
+    return;
+  }
+  acquire(&slotlock);
+  if(s >= nslot() || slotref[s] == 0)
+    panic("swapdup");
+  slotref[s]++;
+  release(&slotlock);
+}
+
+// Drop a reference to slot s.
+void
+swapfree(int s)
+{
+  if(s >= ZSLOT){
+    zramfree(s - ZSLOT);
+    return;
+  }
+  acquire(&slotlock);
+  if(s >= nslot() || slotref[s] == 0)
+    panic("swapfree");
+  if(--slotref[s] == 0)
+    nslotused--;
+  release(&slotlock);
+}
+
+// Bytes of swap free.
+uint64
+swapspace(void)
+{
+  return (uint64)(nslot() - lockfree_read4(&nslotused)) * PGSIZE;
+}
+
+// Bytes of swap in use on disk.
+uint64
+swapused(void)
+{
+  return (uint64)lockfree_read4(&nslotused) * PGSIZE;
+}
+
+// Report the number of swapin()s from compressed entries and
+// from disk, and the microseconds each kind took in all.
+void
+swapstats(uint64 *nz, uint64 *zus, uint64 *ndisk, uint64 *diskus)
+{
+  *nz = lockfree_read8(&nzfault);
+  *zus = lockfree_read8(&zfaulttime) * 1000000 / MTIME_HZ;
+  *ndisk = lockfree_read8(&ndiskfault);
+  *diskus = lockfree_read8(&diskfaulttime) * 1000000 / MTIME_HZ;
+}
+
+// Read or write page pa from or to slot s.
+static void
+swaprw(int s, char *pa, int write)
+{
+  acquiresleep(&iolock);
+  for(int i = 0; i < PGBLKS; i++){
+    iobuf.blockno = sb.swapstart + s*PGBLKS + i;
+    if(write)
+      memmove(iobuf.data, pa + i*BSIZE, BSIZE);
+    virtio_disk_rw(&iobuf, write);
+    if(!write)
+      memmove(pa + i*BSIZE, iobuf.data, BSIZE);
+  }
+  releasesleep(&iolock);
+}
+
+// May swapout() change p's page table? p->lock must be held.
+static int
+swappable(struct proc *p)
+{
+  return p->pagetable && (p == myproc() || p->state == SLEEPING);
+}
+
+// Make p see a change to its PTE for va. p->lock must be held.
+static void
+swapflush(struct proc *p, uint64 va)
+{
+  if(p == myproc())
+    tlbflush(p->pagetable, va, 1);
+  else
+    p->asidcpu = -1;  // so uvmsatp() flushes when p next runs
+}
+
+// Sweep the hand on through p's memory to a page that hasn't
+// been used since the hand last passed it, and page it out.
+// Returns 1 if a page was freed, 0 if the hand reached the end
+// of p's memory, -1 if swap is full.
+static int
+swapone(struct proc *p)
+{
+  pagetable_t pagetable, pt;
+  pte_t *pte, old;
+  uint64 va, pa;
+  int pid, s, dirty;
+
+  acquire(&p->lock);
+  for(;;){
+    if(!swappable(p)){
+      release(&p->lock);
+      return 0;
+    }
+    pagetable = p->pagetable;
+    pid = p->pid;
+    for(; handva < p->sz; handva += PGSIZE){
+      if((pt = walkpt(pagetable, handva)) == 0){
+        handva = MEGAPGROUNDDOWN(handva) + MEGAPGSIZE - PGSIZE;
+        continue;
+      }
+      pte = &pt[PX(0, handva)];
+      if((*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U))
+        continue;
+      pa = PTE2PA(*pte);
+      // the kernel's direct map holds one reference.
+      if(knumreference((void*)pa) != 2 || kpageflags((void*)pa, PG_PINNED))
+        continue;
+      if(*pte & PTE_A){
+        *pte &= ~PTE_A;
+        swapflush(p, handva);
+        continue;
+      }
+      break;
+    }
+    if(handva >= p->sz){
+      release(&p->lock);
+      return 0;
+    }
+
+    // a write from now on sets PTE_D again. hold a reference so
+    // the page stays while the lock is let go for the write.
+    va = handva;
+    handva += PGSIZE;
+    dirty = (*pte & PTE_D) != 0;
+    *pte &= ~PTE_D;
+    old = *pte;
+    swapflush(p, va);
+    kreference((void*)pa);
+    release(&p->lock);
+
+    s = kswapslot((void*)pa);
+    if(dirty || s < 0){
+      if(s >= 0){
+        ksetswapslot((void*)pa, -1);
+        swapfree(s);
+      }
+      // compressed, if it compresses well, else to disk.
+      if((s = zramput((char*)pa)) >= 0){
+        s += ZSLOT;
+      } else if((s = swapalloc()) >= 0){
+        swaprw(s, (char*)pa, 1);
+        ksetswapslot((void*)pa, s);
+      }
+    }
+
+    // the page goes only if no one used it meanwhile.
+    acquire(&p->lock);
+    if(s >= 0 && swappable(p) && p->pid == pid && p->pagetable == pagetable &&
+       (pt = walkpt(pagetable, va)) != 0 && pt[PX(0, va)] == old &&
+       knumreference((void*)pa) == 3){
+      pt[PX(0, va)] = SLOT2PTE(s) | (PTE_FLAGS(old) & ~(PTE_V|PTE_A|PTE_D)) | PTE_SWAP;
+      swapflush(p, va);
+      release(&p->lock);
+      // the PTE has the page's reference to the slot now.
+      ksetswapslot((void*)pa, -1);
+      kdereference((void*)pa);
+      if(kdereference((void*)pa) != 1)
+        panic("swapone");
+      kfree((void*)pa);
+      return 1;
+    }
+    release(&p->lock);
+    if(kdereference((void*)pa) == 1)
+      kfree((void*)pa);
+    if(s < 0)
+      return -1;
+    // a disk copy stays with the page; a compressed one goes.
+    if(s >= ZSLOT)
+      swapfree(s);
+    acquire(&p->lock);
+  }
+}
+
+// Page out up to n pages, sweeping the hand over each process
+// at most twice. Returns the number of pages freed.
+static int
+swapout(int n)
+{
+  int freed = 0, r;
+
+  acquiresleep(&swaplock);
+  for(int visits = 0; freed < n && visits < 2*NPROC; ){
+    if((r = swapone(&proc[hand])) < 0)
+      break;
+    if(r > 0){
+      freed++;
+      continue;
+    }
+    hand = (hand + 1) % NPROC;
+    handva = 0;
+    visits++;
+  }
+  releasesleep(&swaplock);
+  return freed;
+}
+
+// Page out memory until SWAPLOW pages are free, or no more can
+// be. Called with no locks held, since it may sleep.
+void
+swapreclaim(void)
+{
+  while(free_physical_memory() < SWAPLOW * PGSIZE && swapout(SWAPBATCH) > 0)
+    ;
+}
+
+// If p's page at va is on swap, read it in and map it again.
+// p must be the current process.
+// Returns 0 on success, 1 if va isn't on swap, -1 if it is but
+// memory ran out; the page then stays on swap.
+int
+swapin(struct proc *p, uint64 va)
+{
+  pte_t *pte, old;
+  uint64 t0 = r_time();
+  char *mem;
+  int s;
+
+  va = PGROUNDDOWN(va);
+  if(va >= MAXVA || (pte = walkswap(p->pagetable, va)) == 0)
+    return 1;
+  old = *pte;
+  s = PTE2SLOT(old);
+  if((mem = kalloc()) == 0)
+    return -1;
+  if(s >= ZSLOT){
+    zramget(s - ZSLOT, mem);
+    swapfree(s);
+  } else {
+    // while p sleeps here, swapout() leaves its swap PTEs alone
+    // and frees no page-table pages, so pte stays put.
+    swaprw(s, mem, 0);
+    // the PTE's reference to the slot is the page's now.
+    ksetswapslot(mem, s);
+  }
+  *pte = PA2PTE(mem) | (PTE_FLAGS(old) & ~PTE_SWAP) | PTE_V | PTE_A;
+  kreference(mem);
+  tlbflush(p->pagetable, va, 1);
+
+  if(s >= ZSLOT){
+    __sync_fetch_and_add(&nzfault, 1);
+    __sync_fetch_and_add(&zfaulttime, r_time() - t0);
+  } else {
+    __sync_fetch_and_add(&ndiskfault, 1);
+    __sync_fetch_and_add(&diskfaulttime, r_time() - t0);
+  }
+  return 0;
+}
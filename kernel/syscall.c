@@ -87,6 +87,13 @@ extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
 extern uint64 sys_fmem(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_shmmap(void);
+extern uint64 sys_ksm(void);
+extern uint64 sys_pgstate(void);
+extern uint64 sys_madvise(void);
 #ifdef LAB_NET
 extern uint64 sys_connect(void);
 #endif
@@ -129,6 +136,13 @@ static uint64 (*syscalls[])(void) = {
 [SYS_pgaccess] sys_pgaccess,
 #endif
 [SYS_fmem]    sys_fmem,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_spawn]   sys_spawn,
+[SYS_shmmap]  sys_shmmap,
+[SYS_ksm]     sys_ksm,
+[SYS_pgstate] sys_pgstate,
+[SYS_madvise] sys_madvise,
 [SYS_trace]   sys_trace,
 [SYS_sysinfo] sys_sysinfo,
 [SYS_sigalarm]   sys_sigalarm,
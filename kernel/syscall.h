@@ -31,3 +31,8 @@
 #define SYS_connect   29
 #define SYS_pgaccess  30
 #define SYS_fmem   31
+#define SYS_spawn  32
+#define SYS_shmmap 33
+#define SYS_ksm    34
+#define SYS_pgstate 35
+#define SYS_madvise 36
@@ -2,33 +2,46 @@
 #include "riscv.h"
 #include "defs.h"
 #include "param.h"
+#include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
 #include "sysinfo.h"
 
+// Fill in info from counters that the kernel keeps up to date
+// as it runs, and small tables; nothing here takes a lock.
 int sysinfo(struct sysinfo *info) {
   // Calculate Free Memory
   info->freemem = free_physical_memory();
+  info->freepages = info->freemem / PGSIZE;
+  info->cowpages = kcowpages();
+  info->swapused = swapused();
+  zramstats(&info->zpages, &info->zbytes);
+  swapstats(&info->zfaults, &info->zfaultus, &info->swapfaults, &info->swapfaultus);
+  ksmstats(&info->ksmshared, &info->ksmsaved);
   // Calculate Number of processes
   info->nproc = num_procs();
+  info->nrunnable = num_procs_state(RUNNABLE);
+  info->nsleeping = num_procs_state(SLEEPING);
+  bstats(&info->bhits, &info->bmisses);
+  for (int i = 0; i < NCPU; i++) {
+    info->idle[i] = lockfree_read8(&cpus[i].idle) * 1000000 / MTIME_HZ;
+  }
+  info->cowfaults = myproc()->cowfaults;
+  info->cowcopies = myproc()->cowcopies;
   return 0;
 }
 
 uint64 sys_sysinfo(void) {
   struct proc *p = myproc();
+  struct sysinfo info;
 
   uint64 info_user;
   argaddr(0, &info_user);
 
-  uint64 fmem = free_physical_memory();
-  if (copyout(p->pagetable, (uint64)(&((struct sysinfo *) info_user)->freemem), (char *) &fmem, sizeof(uint64)) < 0) {
-    return -1;
-  }
-
-  uint64 nproc = num_procs();
-  if (copyout(p->pagetable, (uint64)(&((struct sysinfo *) info_user)->nproc), (char *) &nproc, sizeof(uint64)) < 0) {
+  sysinfo(&info);
+  if (copyout(p->pagetable, info_user, (char *) &info, sizeof(info)) < 0) {
     return -1;
   }
 
   return 0;
-}
\ No newline at end of file
+}
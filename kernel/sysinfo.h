@@ -1,4 +1,22 @@
 struct sysinfo {
   uint64 freemem;   // amount of free memory (bytes)
   uint64 nproc;     // number of process
+  uint64 freepages; // number of free physical pages
+  uint64 cowpages;  // physical pages shared copy-on-write
+  uint64 nrunnable; // processes waiting for a CPU
+  uint64 nsleeping; // processes blocked in sleep()
+  uint64 bhits;     // buffer cache reads served from memory
+  uint64 bmisses;   // buffer cache reads that went to disk
+  uint64 idle[NCPU]; // per-CPU time spent idle (microseconds)
+  uint64 cowfaults; // copy-on-write faults taken by the caller
+  uint64 cowcopies; // pages those faults copied
+  uint64 swapused;  // bytes of swap holding paged-out memory
+  uint64 zpages;    // paged-out pages kept compressed in memory
+  uint64 zbytes;    // memory they take (bytes)
+  uint64 zfaults;   // page faults that decompressed a page
+  uint64 zfaultus;  // time they took (microseconds)
+  uint64 swapfaults; // page faults that read a page from swap
+  uint64 swapfaultus; // time they took (microseconds)
+  uint64 ksmshared; // pages shared by same-page merging
+  uint64 ksmsaved;  // pages that sharing saves
 };
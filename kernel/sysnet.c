@@ -25,11 +25,19 @@ struct sock {
 
 static struct spinlock lock;
 static struct sock *sockets;
+static struct kmem_cache *sockcache;
+
+static void
+sockctor(void *p)
+{
+  initlock(&((struct sock*)p)->lock, "sock");
+}
 
 void
 sockinit(void)
 {
   initlock(&lock, "socktbl");
+  sockcache = kmem_cache_create("sock", sizeof(struct sock), sockctor);
 }
 
 int
@@ -41,14 +49,13 @@ sockalloc(struct file **f, uint32 raddr, uint16 lport, uint16 rport)
   *f = 0;
   if ((*f = filealloc()) == 0)
     goto bad;
-  if ((si = (struct sock*)kalloc()) == 0)
+  if ((si = (struct sock*)kmem_cache_alloc(sockcache)) == 0)
     goto bad;
 
   // initialize objects
   si->raddr = raddr;
   si->lport = lport;
   si->rport = rport;
-  initlock(&si->lock, "sock");
   mbufq_init(&si->rxq);
   (*f)->type = FD_SOCK;
   (*f)->readable = 1;
@@ -74,7 +81,7 @@ sockalloc(struct file **f, uint32 raddr, uint16 lport, uint16 rport)
 
 bad:
   if (si)
-    kfree((char*)si);
+    kmem_cache_free(sockcache, si);
   if (*f)
     fileclose(*f);
   return -1;
@@ -104,7 +111,7 @@ sockclose(struct sock *si)
     mbuffree(m);
   }
 
-  kfree((char*)si);
+  kmem_cache_free(sockcache, si);
 }
 
 int
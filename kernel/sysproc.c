@@ -98,6 +98,21 @@ sys_pgaccess(void)
 }
 #endif
 
+// pgstate(addr, npages, abits, dbits, flags)
+uint64
+sys_pgstate(void)
+{
+  uint64 va, abits, dbits;
+  int npages, flags;
+
+  argaddr(0, &va);
+  argint(1, &npages);
+  argaddr(2, &abits);
+  argaddr(3, &dbits);
+  argint(4, &flags);
+  return pgstate(myproc(), va, npages, abits, dbits, flags);
+}
+
 uint64
 sys_kill(void)
 {
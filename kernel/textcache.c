@@ -0,0 +1,138 @@
+// Text page cache.
+//
+// Keeps the read-only pages of executables that execfault() has
+// read in, keyed by (dev, inum, file offset), so that another
+// process running the same program maps the same physical page
+// instead of reading the file into a copy of its own.
+//
+// The cache holds a reference to each of its pages. writei() and
+// itrunc() drop the pages of an inode they change, which no
+// process is running (see execload()), for the next to exec it.
+// When the cache is full, the next page added replaces one that
+// no process maps, if any.
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+
+struct textpage {
+  uint dev;
+  uint inum;
+  uint64 off;     // file offset of the page's first byte
+  uint n;         // bytes from the file; the rest is zero
+  char *pa;       // 0 if the entry is free
+};
+
+static struct spinlock textlock;
+static struct textpage text[NTEXTPG];
+static int hand;  // next entry to consider replacing
+
+void
+textinit(void)
+{
+  initlock(&textlock, "text");
+}
+
+static struct textpage*
+textfind(uint dev, uint inum, uint64 off, uint n)
+{
+  struct textpage *t;
+
+  for(t = text; t < &text[NTEXTPG]; t++)
+    if(t->pa && t->dev == dev && t->inum == inum && t->off == off && t->n == n)
+      return t;
+  return 0;
+}
+
+// Drop the cache's reference to t's page. textlock must be held.
+static void
+textdrop(struct textpage *t)
+{
+  if(kdereference(t->pa) == 1)
+    kfree(t->pa);
+  t->pa = 0;
+}
+
+// Return the cached page holding bytes [off, off+n) of inode
+// (dev, inum), with a reference for the caller, or 0.
+char*
+textget(uint dev, uint inum, uint64 off, uint n)
+{
+  struct textpage *t;
+  char *pa = 0;
+
+  acquire(&textlock);
+  if((t = textfind(dev, inum, off, n)) != 0){
+    pa = t->pa;
+    kreference(pa);
+  }
+  release(&textlock);
+  return pa;
+}
+
+// Add mem, just read from bytes [off, off+n) of inode (dev, inum),
+// to the cache. The caller must hold the inode's lock, so that no
+// write can come between the read and this.
+// Returns the cached page, with a reference for the caller: mem,
+// or, if another process added the same page first, that page,
+// in which case mem is freed.
+char*
+textadd(uint dev, uint inum, uint64 off, uint n, char *mem)
+{
+  struct textpage *t;
+  int i;
+
+  acquire(&textlock);
+  if((t = textfind(dev, inum, off, n)) != 0){
+    kfree(mem);
+    mem = t->pa;
+    kreference(mem);
+    release(&textlock);
+    return mem;
+  }
+
+  // a free entry, else one whose page no process maps,
+  // else the next one round.
+  t = 0;
+  for(i = 0; i < NTEXTPG && t == 0; i++){
+    if(text[i].pa == 0)
+      t = &text[i];
+  }
+  for(i = 0; i < NTEXTPG && t == 0; i++){
+    if(knumreference(text[hand].pa) == 2)
+      t = &text[hand];
+    hand = (hand + 1) % NTEXTPG;
+  }
+  if(t == 0){
+    t = &text[hand];
+    hand = (hand + 1) % NTEXTPG;
+  }
+  if(t->pa)
+    textdrop(t);
+
+  t->dev = dev;
+  t->inum = inum;
+  t->off = off;
+  t->n = n;
+  t->pa = mem;
+  kreference(mem);  // the cache's
+  kreference(mem);  // the caller's
+  release(&textlock);
+  return mem;
+}
+
+// Forget the cached pages of inode (dev, inum), whose contents
+// are changing.
+void
+textinval(uint dev, uint inum)
+{
+  struct textpage *t;
+
+  acquire(&textlock);
+  for(t = text; t < &text[NTEXTPG]; t++)
+    if(t->pa && t->dev == dev && t->inum == inum)
+      textdrop(t);
+  release(&textlock);
+}
@@ -10,12 +10,14 @@ struct spinlock tickslock;
 uint ticks;
 
 extern char trampoline[], uservec[], userret[], useralarmret[];
+extern char ucopy_start[], ucopy_end[], ucopy_fault[]; // ucopy.S
 
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
 
 extern int devintr();
 int handle_pagefault();
+static int uvmfault(struct proc*, uint64, int);
 
 void
 trapinit(void)
@@ -65,6 +67,9 @@ usertrap(void)
     // so enable only now that we're done with those registers.
     intr_on();
 
+    // page memory out now, while no locks are held, if it's short.
+    swapreclaim();
+
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
@@ -131,7 +136,7 @@ alarmret(void) {
   w_sstatus(x);
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->alarm_handler);
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = uvmsatp(p);
   ((void (*)(uint64))trampoline_userret)(satp);
 }
 
@@ -171,8 +176,9 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // tell trampoline.S the user page table to switch to,
+  // tagged with p's ASID.
+  uint64 satp = uvmsatp(p);
 
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -196,6 +202,19 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
+  // a load or store to user memory by ucopy.S. if the page
+  // can't be faulted in, the copy returns -1. faulting in may
+  // sleep, so a copy made with a spinlock held fails instead;
+  // uaccess_touch() faults the pages in ahead of such copies.
+  if((scause == 13 || scause == 15) && myproc() != 0 &&
+     sepc >= (uint64)ucopy_start && sepc < (uint64)ucopy_end){
+    if(holdingspin() || uvmfault(myproc(), r_stval(), scause == 15) != 0)
+      sepc = (uint64)ucopy_fault;
+    w_sepc(sepc);
+    w_sstatus(sstatus);
+    return;
+  }
+
   if((which_dev = devintr()) == 0){
     printf("scause %p\n", scause);
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -277,52 +296,46 @@ devintr()
   }
 }
 
-int
-handle_pagefault() {
-  if (r_scause() != 0x000000000000000f) {
-    return 0;
-  }
+// Fault in the page at va of p for a read or write: a page on
+// swap; a page of the program, a heap page that sbrk() reserved,
+// or an mmap() page, that nothing has touched yet; or a
+// copy-on-write page being written.
+// Returns 0 on success, -1 if the access is an error.
+static int
+uvmfault(struct proc *p, uint64 va, int write)
+{
+  int mega;
+  pte_t *pte;
 
-  // page fault has scause 0xf
-  struct proc *p = myproc();
-  // this is the virtual address causing page fault
-  uint64 va = r_stval();
   va = PGROUNDDOWN(va);
+  if (va >= MAXVA)
+    return -1;
 
-  if (va >= MAXVA) {
-    setkilled(p);
-    return 1;
+  pte = walkleaf(p->pagetable, va, &mega);
+  if (pte == 0 || (*pte & PTE_V) == 0) {
+    return uvmfaultin(p, va, write);
   }
 
-  pte_t *pte = walk(p->pagetable, va, 0);
-
-  if (pte == 0) {
-    setkilled(p);
-    return 1;
-  }
-  uint flags = PTE_FLAGS(*pte);
-  uint64 pa = PTE2PA(*pte);
+  // otherwise, only a write to a COW page is allowed.
+  if (!write || (*pte & PTE_COW) == 0)
+    return -1;
+  return uvmcow(p->pagetable, va);
+}
 
-  // if this is not a COW page, also kill the process
-  if ((flags & PTE_COW) == 0) {
-    setkilled(p);
-    return 1;
+// Handle a page fault from user space with uvmfault().
+// Returns 0 if scause is not a page fault. Otherwise returns 1,
+// having killed the process if the fault was an error.
+int
+handle_pagefault() {
+  uint64 scause = r_scause();
+  if (scause != 12 && scause != 13 && scause != 15) {
+    return 0;
   }
 
-  flags = (flags | PTE_W) & ~PTE_COW;
-
-  // This is a COW page, copy a new one and modify the mapping
-  char *mem = kalloc();
-  if (mem == 0) {
-    setkilled(p);
-    return 1;
-  }
-  
-  memmove(mem, (void*)pa, PGSIZE);
-  uvmunmap(p->pagetable, va, 1, 1);
-  if (mappages(p->pagetable, va, PGSIZE, (uint64) mem, flags) != 0) {
+  // instruction page fault has scause 12, load 13, store 15
+  struct proc *p = myproc();
+  swapreclaim();
+  if (uvmfault(p, r_stval(), scause == 15) != 0)
     setkilled(p);
-    return 1;
-  }
   return 1;
 }
@@ -0,0 +1,16 @@
+// A cursor for copying to and from one page table's user memory.
+// It remembers the page it last translated and the leaf
+// page-table page that maps it, so a copy that runs on into the
+// next page reads that page's PTE directly rather than walking
+// from the root.
+//
+// The cached translation is only good until the page table
+// changes, so start a new cursor with uaccess_init() after
+// anything that may sleep or unmap memory.
+struct uaccess {
+  pagetable_t pagetable;
+  uint64 va;          // user page last translated, or -1
+  uint64 pa;          // kernel address of its contents
+  int write;          // translated for writing
+  pagetable_t leaf;   // leaf page-table page that maps va, or 0
+};
@@ -7,6 +7,9 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "fs.h"
+#include "page.h"
+#include "uaccess.h"
+#include "fcntl.h"
 
 /*
  * the kernel's page table.
@@ -17,14 +20,67 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+static pte_t *walklevel(pagetable_t, uint64, int, int);
+static int splitmega(pte_t *);
+static int ptunshare(pagetable_t, pte_t *, uint64);
+static void ptprune(pagetable_t, uint64);
+
+// fork() shares leaf page-table pages between parent and child
+// rather than copying them. A leaf table's reference count is
+// the number of page tables that share it; every PTE in a shared
+// table is read-only. Before any PTE in one changes, walk() gives
+// the page table its own copy (ptunshare()). The lock serializes
+// the decisions that depend on the count: copying, and dropping
+// one page table's share (ptdrop()).
+static struct spinlock ptshare_lock;
+
+// A page of zeroes, mapped read-only and copy-on-write at
+// every heap page that has been read but not yet written.
+// It holds an extra reference so that it is never freed.
+static char *zeropage;
+
+// ASIDs tag each user page table's TLB entries, so returning to
+// user space needn't flush the TLB; the kernel page table uses
+// ASID 0. ASIDs are handed out in generations, kept in the bits
+// of p->asid above the ASID. When a generation runs out, the
+// next one starts: each process gets a new ASID when it next
+// returns to user space, and each hart flushes its whole TLB
+// before it first uses an ASID of the new generation.
+#define ASIDGEN (SATP_ASID_MASK + 1)
+
+#define COWBATCH 8  // COW pages resolved at once on sequential writes
+
+// Each page-table page keeps a count of its PTEs that aren't zero
+// (kptes()), valid or on swap, so that uvmunmap() can free a
+// table as soon as it maps nothing. Changes between zero and
+// non-zero go through ptset().
+#define PTPAGE(pte) ((void*)PGROUNDDOWN((uint64)(pte)))
+
+static void
+ptset(pte_t *pte, pte_t v)
+{
+  if(*pte == 0 && v != 0)
+    kptes(PTPAGE(pte), 1);
+  else if(*pte != 0 && v == 0)
+    kptes(PTPAGE(pte), -1);
+  *pte = v;
+}
+
+struct {
+  struct spinlock lock;
+  uint64 gen;       // current generation, a multiple of ASIDGEN
+  uint64 next;      // next ASID to hand out in this generation
+} asids;
+
+uint64 asidmax;     // largest ASID the hardware has; 0 if none
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -64,6 +120,12 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+  initlock(&ptshare_lock, "ptshare");
+
+  if((zeropage = kalloc_zeroed()) == 0)
+    panic("kvminit: zeropage");
+  kreference(zeropage);
+  kpageset(zeropage, PG_ZEROED | PG_PINNED);
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -74,10 +136,167 @@ kvminithart()
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
-  w_satp(MAKE_SATP(kernel_pagetable));
+  // the ASID bits that stick are the ones the hardware has.
+  w_satp(MAKE_SATP(kernel_pagetable, SATP_ASID_MASK));
+#ifndef NOASID
+  asidmax = (r_satp() >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+#endif
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
 
   // flush stale entries from the TLB.
   sfence_vma();
+
+  if(cpuid() == 0){
+    initlock(&asids.lock, "asid");
+    asids.gen = ASIDGEN;
+    asids.next = 1;
+  }
+  mycpu()->asidgen = ASIDGEN;
+}
+
+// Each process has a kernel page table of its own, in which the
+// kernel can reach the process's memory below PLIC with plain
+// loads and stores (ucopy.S). It is a copy of kernel_pagetable's
+// root page whose first entry points at the user page table's
+// own level-1 page-table page, so changes to the user mappings
+// show up in it with nothing to keep in sync. That level-1 page
+// holds the kernel's device mappings at and above PLIC too, not
+// PTE_U, so user memory must stay below PLIC.
+//
+// All kernel page tables use ASID 0; a hart flushes its entries
+// whenever it switches from one to another (kvmswitch()).
+
+// Make a kernel page table for a process with user page table
+// pagetable, which uvmkmap() has been called on.
+// Returns 0 if out of memory.
+pagetable_t
+kvmcreate(pagetable_t pagetable)
+{
+  pagetable_t kpt;
+
+  if((kpt = (pagetable_t)kalloc()) == 0)
+    return 0;
+  memmove(kpt, kernel_pagetable, PGSIZE);
+  kpt[0] = pagetable[0];
+  return kpt;
+}
+
+// Point p's kernel page table at p's new user page table.
+void
+kvmuser(struct proc *p)
+{
+  p->kpagetable[0] = p->pagetable[0];
+  if(p == myproc())
+    sfence_vma_asid(0);
+}
+
+// Switch this hart to kernel page table pagetable.
+void
+kvmswitch(pagetable_t pagetable)
+{
+  w_satp(MAKE_SATP(pagetable, 0));
+  sfence_vma_asid(0);
+}
+
+// Give user page table pagetable the kernel's mappings in its
+// first GB, which are all at or above PLIC.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmkmap(pagetable_t pagetable)
+{
+  pagetable_t kl1, ul1;
+
+  if(walklevel(pagetable, 0, 1, 1) == 0)
+    return -1;
+  kl1 = (pagetable_t)PTE2PA(kernel_pagetable[0]);
+  ul1 = (pagetable_t)PTE2PA(pagetable[0]);
+  for(int i = PX(1, PLIC); i < 512; i++)
+    ul1[i] = kl1[i];
+  return 0;
+}
+
+// Take the kernel's mappings back out of pagetable, so that
+// freeing it doesn't free them.
+void
+uvmkunmap(pagetable_t pagetable)
+{
+  pagetable_t ul1;
+
+  if((pagetable[0] & PTE_V) == 0)
+    return;
+  ul1 = (pagetable_t)PTE2PA(pagetable[0]);
+  for(int i = PX(1, PLIC); i < 512; i++)
+    ul1[i] = 0;
+}
+
+// Return the satp value for running p in user space, giving p
+// a new ASID if it has none from the current generation, and
+// flush whatever this hart's TLB may hold for it that is stale.
+// Called by usertrapret() with interrupts off.
+uint64
+uvmsatp(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 gen;
+
+  // without ASIDs, trampoline.S flushes the TLB every time.
+  if(asidmax == 0)
+    return MAKE_SATP(p->pagetable, 0);
+
+  gen = lockfree_read8(&asids.gen);
+  if((p->asid & ~SATP_ASID_MASK) != gen){
+    acquire(&asids.lock);
+    if(asids.next > asidmax){
+      asids.gen += ASIDGEN;
+      asids.next = 1;
+    }
+    p->asid = asids.gen | asids.next++;
+    gen = asids.gen;
+    release(&asids.lock);
+  }
+
+  if(c->asidgen != gen){
+    sfence_vma();
+    c->asidgen = gen;
+  } else if(p->asidcpu != cpuid()){
+    // p's page table may have changed since it last ran here.
+    sfence_vma_asid(p->asid & SATP_ASID_MASK);
+  }
+  p->asidcpu = cpuid();
+  return MAKE_SATP(p->pagetable, p->asid & SATP_ASID_MASK);
+}
+
+// Flush this hart's TLB entries for npages pages at va, if
+// pagetable is the current process's. Other harts flush when
+// the process next runs there (uvmsatp()).
+void
+tlbflush(pagetable_t pagetable, uint64 va, uint64 npages)
+{
+  struct proc *p = myproc();
+  uint64 asid;
+
+  if(p == 0 || p->pagetable != pagetable)
+    return;
+
+  // the kernel's view through p's kernel page table.
+  if(va < PLIC){
+    if(npages > 32){
+      sfence_vma_asid(0);
+    } else {
+      for(uint64 i = 0; i < npages; i++)
+        sfence_vma_page(va + i*PGSIZE, 0);
+    }
+  }
+
+  asid = p->asid & SATP_ASID_MASK;
+  if(asidmax == 0 || asid == 0)
+    return;
+  if(npages > 32){
+    sfence_vma_asid(asid);
+    return;
+  }
+  for(uint64 i = 0; i < npages; i++)
+    sfence_vma_page(va + i*PGSIZE, asid);
 }
 
 // Return the address of the PTE in page table pagetable
@@ -92,24 +311,281 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A megapage leaf on the way down is split into 4 KB pages;
+// walk() returns 0 if that needs memory and there is none.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
+  return walklevel(pagetable, va, 0, alloc);
+}
+
+// Like walk(), but return the PTE at level 1 or 0.
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int to, int alloc)
+{
+  pagetable_t root = pagetable;
+
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
+  for(int level = 2; level > to; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte) && splitmega(pte) != 0)
+        return 0;
+      if(level == 1 && knumreference((void*)PTE2PA(*pte)) > 1 &&
+         ptunshare(root, pte, va) != 0)
+        return 0;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
-      *pte = PA2PTE(pagetable) | PTE_V;
+      ptset(pte, PA2PTE(pagetable) | PTE_V);
+    }
+  }
+  return &pagetable[PX(to, va)];
+}
+
+// Return the leaf PTE that maps va, without splitting a
+// megapage or unsharing a leaf table, so only for reading it;
+// *mega is set if it is a level-1 leaf.
+// Returns 0 if va is not mapped.
+pte_t *
+walkleaf(pagetable_t pagetable, uint64 va, int *mega)
+{
+  pte_t *pte = 0;
+
+  if(va >= MAXVA)
+    return 0;
+
+  for(int level = 2; level >= 0; level--) {
+    pte = &pagetable[PX(level, va)];
+    if((*pte & PTE_V) == 0)
+      return 0;
+    if(PTE_LEAF(*pte)){
+      *mega = level > 0;
+      return pte;
+    }
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  }
+  return 0;
+}
+
+// Return the level-1 PTE for va, without allocating, splitting
+// or unsharing anything, or 0 if there is no level-1 table.
+static pte_t *
+walkl1(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte = &pagetable[PX(2, va)];
+
+  if((*pte & PTE_V) == 0)
+    return 0;
+  pagetable = (pagetable_t)PTE2PA(*pte);
+  return &pagetable[PX(1, va)];
+}
+
+// Return the leaf page-table page that maps the 2 MB holding va,
+// if pagetable has one that no other page table shares, else 0.
+// Changes nothing.
+pagetable_t
+walkpt(pagetable_t pagetable, uint64 va)
+{
+  pte_t *l1;
+  pagetable_t pt;
+
+  if(va >= MAXVA || (l1 = walkl1(pagetable, va)) == 0 ||
+     (*l1 & PTE_V) == 0 || PTE_LEAF(*l1))
+    return 0;
+  pt = (pagetable_t)PTE2PA(*l1);
+  if(knumreference(pt) != 1)
+    return 0;
+  return pt;
+}
+
+// Return the PTE for va if the page is on swap, else 0. Only
+// unshared leaf tables hold swap PTEs (see ptshare()).
+pte_t *
+walkswap(pagetable_t pagetable, uint64 va)
+{
+  pagetable_t pt;
+  pte_t *pte;
+
+  if((pt = walkpt(pagetable, va)) == 0)
+    return 0;
+  pte = &pt[PX(0, va)];
+  if((*pte & (PTE_V | PTE_SWAP)) != PTE_SWAP)
+    return 0;
+  return pte;
+}
+
+// Give pagetable its own copy of the shared leaf table that its
+// level-1 PTE *l1 for va points to. The copy maps the same pages,
+// so each gains a reference.
+// Returns 0 on success, -1 if out of memory.
+static int
+ptunshare(pagetable_t pagetable, pte_t *l1, uint64 va)
+{
+  pagetable_t old, new;
+
+  acquire(&ptshare_lock);
+  old = (pagetable_t)PTE2PA(*l1);
+  // the other page tables may have let go meanwhile.
+  if(knumreference(old) == 1){
+    release(&ptshare_lock);
+    return 0;
+  }
+  if((new = (pagetable_t)kalloc()) == 0){
+    release(&ptshare_lock);
+    return -1;
+  }
+  for(int i = 0; i < 512; i++){
+    new[i] = old[i];
+    if((old[i] & PTE_V) && PTE2PA(old[i]) > KERNBASE)
+      kreference((void*)PTE2PA(old[i]));
+  }
+  kptes(new, kptes(old, 0));
+  *l1 = PA2PTE(new) | PTE_V;
+  kdereference(old);
+  release(&ptshare_lock);
+
+  // the TLB may cache the old table.
+  tlbflush(pagetable, MEGAPGROUNDDOWN(va), MEGAPGSIZE / PGSIZE);
+  return 0;
+}
+
+// If the leaf table that level-1 PTE *l1 (for the 2 MB at base)
+// points to is shared and maps nothing outside [start, end),
+// just drop pagetable's share of it, leaving its pages to the
+// other page tables. Returns 1 if it did, 0 if not.
+static int
+ptdrop(pagetable_t pagetable, pte_t *l1, uint64 base, uint64 start, uint64 end)
+{
+  pagetable_t pt = (pagetable_t)PTE2PA(*l1);
+
+  if(knumreference(pt) == 1)
+    return 0;
+  // no one changes the PTEs of a shared table.
+  for(int i = 0; i < 512; i++){
+    uint64 a = base + i*PGSIZE;
+    if((pt[i] & PTE_V) && (a < start || a >= end))
+      return 0;
+  }
+
+  acquire(&ptshare_lock);
+  if(knumreference(pt) == 1){
+    release(&ptshare_lock);
+    return 0;
+  }
+  ptset(l1, 0);
+  kdereference(pt);
+  release(&ptshare_lock);
+  tlbflush(pagetable, base, MEGAPGSIZE / PGSIZE);
+  return 1;
+}
+
+// Share old's leaf table for the 2 MB at base with new, if it
+// maps only pages in [start, end) and new has no table there.
+// Its writable PTEs become copy-on-write first.
+// Returns 1 if shared, 0 if not, -1 if out of memory.
+static int
+ptshare(pagetable_t old, pagetable_t new, uint64 base, uint64 start, uint64 end)
+{
+  pte_t *l1, *nl1;
+  pagetable_t pt;
+  int n = 0;
+
+  if((l1 = walkl1(old, base)) == 0 || (*l1 & PTE_V) == 0 || PTE_LEAF(*l1))
+    return 0;
+  pt = (pagetable_t)PTE2PA(*l1);
+  for(int i = 0; i < 512; i++){
+    uint64 a = base + i*PGSIZE;
+    // swap.c only looks in tables that aren't shared.
+    if(pt[i] & PTE_SWAP)
+      return 0;
+    if((pt[i] & PTE_V) == 0)
+      continue;
+    if(a < start || a >= end)
+      return 0;
+    n++;
+  }
+  if(n == 0)
+    return 0;
+  if((nl1 = walklevel(new, base, 1, 1)) == 0)
+    return -1;
+  if(*nl1 & PTE_V)
+    return 0;
+
+  // a table that is already shared has no writable PTEs, and
+  // no other page table can start sharing one that old alone has.
+  for(int i = 0; i < 512; i++){
+    if((pt[i] & PTE_V) && (pt[i] & PTE_W)){
+      pt[i] = (pt[i] | PTE_COW) & ~PTE_W;
+      kpageset((void*)PTE2PA(pt[i]), PG_COW);
+    }
+  }
+  acquire(&ptshare_lock);
+  kreference(pt);
+  ptset(nl1, *l1);
+  release(&ptshare_lock);
+  return 1;
+}
+
+// Replace the megapage leaf *pte with a page-table page of 512
+// 4 KB leaves with the same flags. Every 4 KB page is still
+// mapped once, so reference counts don't change.
+// Returns 0 on success, -1 if out of memory.
+static int
+splitmega(pte_t *pte)
+{
+  pagetable_t pagetable;
+  uint64 pa = PTE2PA(*pte);
+  uint flags = PTE_FLAGS(*pte);
+
+  if((pagetable = (pagetable_t)kalloc_zeroed()) == 0)
+    return -1;
+  for(int i = 0; i < 512; i++)
+    pagetable[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  kptes(pagetable, 512);
+  *pte = PA2PTE(pagetable) | PTE_V;
+  return 0;
+}
+
+// Add a reference to each 4 KB page of the megapage at pa.
+static void
+megaref(uint64 pa)
+{
+  for(int i = 0; i < 512; i++)
+    kreference((void*)(pa + i*PGSIZE));
+}
+
+// Drop a reference to each 4 KB page of the megapage at pa and,
+// if do_free, free the pages no one else maps. Another process
+// may still map some of them with 4 KB leaves after splitting
+// its own mapping of the megapage.
+static void
+megaunref(uint64 pa, int do_free)
+{
+  uint64 last[512/64];
+  int all = 1;
+
+  for(int i = 0; i < 512; i++){
+    if(kdereference((void*)(pa + i*PGSIZE)) == 1){
+      last[i/64] |= 1L << (i%64);
+    } else {
+      last[i/64] &= ~(1L << (i%64));
+      all = 0;
     }
   }
-  return &pagetable[PX(0, va)];
+  if(!do_free)
+    return;
+  if(all){
+    kfree_pages((void*)pa, MEGAORDER);
+    return;
+  }
+  for(int i = 0; i < 512; i++)
+    if(last[i/64] & (1L << (i%64)))
+      kfree((void*)(pa + i*PGSIZE));
 }
 
 // Look up a virtual address, return the physical address,
@@ -120,18 +596,16 @@ walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int mega;
 
-  if(va >= MAXVA)
-    return 0;
-
-  pte = walk(pagetable, va, 0);
+  pte = walkleaf(pagetable, va, &mega);
   if(pte == 0)
     return 0;
-  if((*pte & PTE_V) == 0)
-    return 0;
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  if(mega)
+    pa += PGROUNDDOWN(va) & (MEGAPGSIZE-1);
   return pa;
 }
 
@@ -147,7 +621,9 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
+// be page-aligned. Wherever va and pa are both 2 MB-aligned and
+// 2 MB remain, a single megapage leaf maps them.
+// Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
@@ -161,11 +637,27 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
+    if(a % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 && last - a >= MEGAPGSIZE - PGSIZE){
+      if((pte = walklevel(pagetable, a, 1, 1)) == 0)
+        return -1;
+      if(*pte & PTE_V)
+        panic("mappages: remap");
+      ptset(pte, PA2PTE(pa) | perm | PTE_V);
+      if (pa > KERNBASE) {
+        megaref(pa);
+      }
+      if(a + MEGAPGSIZE - PGSIZE == last)
+        break;
+      a += MEGAPGSIZE;
+      pa += MEGAPGSIZE;
+      continue;
+    }
+
     if((pte = walk(pagetable, a, 1)) == 0)
       return -1;
     if(*pte & PTE_V)
       panic("mappages: remap");
-    *pte = PA2PTE(pa) | perm | PTE_V;
+    ptset(pte, PA2PTE(pa) | perm | PTE_V);
 
     if (pa > KERNBASE) {
       kreference((void*) pa);
@@ -176,60 +668,124 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
     a += PGSIZE;
     pa += PGSIZE;
   }
+  // a hart may cache invalid PTEs too.
+  tlbflush(pagetable, PGROUNDDOWN(va), (last - PGROUNDDOWN(va)) / PGSIZE + 1);
   return 0;
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that are not mapped are skipped.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
-  pte_t *pte;
+  uint64 a, end = va + npages*PGSIZE;
+  pte_t *l1, *pte;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
+  for(a = va; a < end; a += PGSIZE){
+    // heap pages that were never touched have no mapping.
+    if((l1 = walkl1(pagetable, a)) == 0 || (*l1 & PTE_V) == 0){
+      a = MEGAPGROUNDDOWN(a) + MEGAPGSIZE - PGSIZE;
+      continue;
+    }
+    if(PTE_LEAF(*l1)){
+      if(a % MEGAPGSIZE == 0 && end - a >= MEGAPGSIZE){
+        uint64 pa = PTE2PA(*l1);
+        ptset(l1, 0);
+        tlbflush(pagetable, a, MEGAPGSIZE / PGSIZE);
+        if(pa > KERNBASE)
+          megaunref(pa, do_free);
+        ptprune(pagetable, a);
+        a += MEGAPGSIZE - PGSIZE;
+        continue;
+      }
+    } else if(ptdrop(pagetable, l1, MEGAPGROUNDDOWN(a), va, end)){
+      ptprune(pagetable, a);
+      a = MEGAPGROUNDDOWN(a) + MEGAPGSIZE - PGSIZE;
+      continue;
+    } else if(knumreference((void*)PTE2PA(*l1)) != 1 &&
+              (((pagetable_t)PTE2PA(*l1))[PX(0, a)] & PTE_V) == 0){
+      // nothing to clear: a shared table has no swap PTEs. leave
+      // it shared rather than copy it, maybe with memory short.
+      continue;
+    }
+
+    // split a megapage, or unshare a leaf table, that the range
+    // cuts through where there is a page to remove. uvmdealloc()
+    // and vmaunmap() do this themselves first, so that they can
+    // fail.
     if((pte = walk(pagetable, a, 0)) == 0)
       panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0) {
-      printf("va=%p pte=%p\n", a, *pte);
-      panic("uvmunmap: not mapped");
-    }
-    if(PTE_FLAGS(*pte) == PTE_V)
-      panic("uvmunmap: not a leaf");
-    
-    uint64 pa = PTE2PA(*pte);
+    if(*pte & PTE_V){
+      uint64 pa = PTE2PA(*pte);
 
-    int can_free = 1;
+      int can_free = 1;
 
-    if (pa > KERNBASE) {
-      kdereference((void*) pa);
-      if (knumreference((void*) pa) != 1) {
+      if (pa > KERNBASE && kdereference((void*) pa) != 1) {
         can_free = 0;
       }
-    }
 
-    if(do_free && can_free){
-      kfree((void*)pa);
+      ptset(pte, 0);
+      tlbflush(pagetable, a, 1);
+
+      if(do_free && can_free){
+        kfree((void*)pa);
+      }
+    } else if(*pte & PTE_SWAP){
+      swapfree(PTE2SLOT(*pte));
+      ptset(pte, 0);
     }
 
-    *pte = 0;
+    // done with this leaf table, which may map nothing now.
+    if((a + PGSIZE) % MEGAPGSIZE == 0 || a + PGSIZE == end)
+      ptprune(pagetable, a);
   }
 }
 
+// Free the leaf page-table page for the 2 MB holding va if it
+// maps nothing, and then the level-1 page above it if that is
+// empty too. The level-1 page for the first GB is kept, since
+// the process's kernel page table points to it (kvmcreate()).
+// The pages are unshared, so no other page table holds them.
+static void
+ptprune(pagetable_t pagetable, uint64 va)
+{
+  pte_t *l2 = &pagetable[PX(2, va)], *l1;
+  pagetable_t pt;
+
+  if((*l2 & PTE_V) == 0)
+    return;
+  l1 = &((pagetable_t)PTE2PA(*l2))[PX(1, va)];
+  if((*l1 & PTE_V) && !PTE_LEAF(*l1)){
+    pt = (pagetable_t)PTE2PA(*l1);
+    if(knumreference(pt) != 1 || kptes(pt, 0) != 0)
+      return;
+    ptset(l1, 0);
+    // the TLB may cache the table's address.
+    tlbflush(pagetable, MEGAPGROUNDDOWN(va), MEGAPGSIZE / PGSIZE);
+    kfree(pt);
+  }
+
+  pt = PTPAGE(l1);
+  if(PX(2, va) == 0 || kptes(pt, 0) != 0)
+    return;
+  ptset(l2, 0);
+  tlbflush(pagetable, MEGAPGROUNDDOWN(va), MEGAPGSIZE / PGSIZE);
+  kfree(pt);
+}
+
 // create an empty user page table.
 // returns 0 if out of memory.
 pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -243,8 +799,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -262,12 +817,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -277,16 +831,37 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
   return newsz;
 }
 
+// Split the megapage, or unshare the leaf table, that holds va,
+// unless va starts a 2 MB stretch, so that uvmunmap() can remove
+// the mappings on either side of va without failing.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmcut(pagetable_t pagetable, uint64 va)
+{
+  pte_t *l1;
+
+  if(va % MEGAPGSIZE != 0 && (l1 = walkl1(pagetable, va)) != 0 && (*l1 & PTE_V) &&
+     walk(pagetable, va, 0) == 0)
+    return -1;
+  return 0;
+}
+
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, or oldsz if a
+// megapage at newsz couldn't be split.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
   if(newsz >= oldsz)
     return oldsz;
 
+  // split a megapage, or unshare a leaf table, that newsz cuts
+  // through, since uvmunmap() can't fail.
+  if(uvmcut(pagetable, PGROUNDUP(newsz)) < 0)
+    return oldsz;
+
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
     uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
@@ -295,6 +870,34 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
   return newsz;
 }
 
+// Drop the user pages of [va, va + npages*PGSIZE), so that the
+// next touch faults each one in again, as for a page never
+// touched. Pages mapped without PTE_U, like the stack's guard
+// page, stay. va must be page-aligned.
+// Returns 0 on success, -1 if a megapage or a leaf table shared
+// with another page table couldn't be split where the range
+// ends; the pages before that point are dropped.
+int
+uvmdrop(pagetable_t pagetable, uint64 va, uint64 npages)
+{
+  uint64 a, start = va, end = va + npages*PGSIZE;
+  pte_t *pte;
+  int mega;
+
+  if(uvmcut(pagetable, va) < 0 || uvmcut(pagetable, end) < 0)
+    return -1;
+  for(a = va; a < end; a += PGSIZE){
+    if((pte = walkleaf(pagetable, a, &mega)) == 0 || (*pte & PTE_U))
+      continue;
+    if(uvmcut(pagetable, a) < 0 || uvmcut(pagetable, a + PGSIZE) < 0)
+      return -1;
+    uvmunmap(pagetable, start, (a - start) / PGSIZE, 1);
+    start = a + PGSIZE;
+  }
+  uvmunmap(pagetable, start, (end - start) / PGSIZE, 1);
+  return 0;
+}
+
 // Recursively free page-table pages.
 // All leaf mappings must already have been removed.
 void
@@ -334,39 +937,332 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
-  uint64 pa, i;
+  return uvmcopyrange(old, new, 0, sz, 0);
+}
+
+// Like uvmcopy(), for the pages in [start, end). If share is
+// set, parent and child keep mapping the pages writable,
+// rather than copy-on-write. Otherwise the child shares each
+// leaf page-table page that maps only pages in the range, so
+// the cost is mostly per 2 MB rather than per page.
+// returns 0 on success, -1 on failure.
+// frees any allocated pages on failure.
+int
+uvmcopyrange(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int share)
+{
+  pte_t *l1, *pte, *npte;
+  uint64 pa, i, size;
   uint flags;
+  int mega, r;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  for(i = start; i < end; i += size){
+    size = PGSIZE;
+    // lazily-allocated heap pages stay lazy in the child.
+    if((l1 = walkl1(old, i)) == 0 || (*l1 & PTE_V) == 0){
+      size = MEGAPGROUNDDOWN(i) + MEGAPGSIZE - i;
+      continue;
+    }
+    if(!share && (i == start || i % MEGAPGSIZE == 0) && !PTE_LEAF(*l1)){
+      if((r = ptshare(old, new, MEGAPGROUNDDOWN(i), start, end)) < 0)
+        goto err;
+      if(r > 0){
+        size = MEGAPGROUNDDOWN(i) + MEGAPGSIZE - i;
+        continue;
+      }
+    }
+
+    if((pte = walkleaf(old, i, &mega)) == 0){
+      // the child gets its own reference to a page on swap.
+      if((pte = walkswap(old, i)) != 0){
+        if((npte = walk(new, i, 1)) == 0)
+          goto err;
+        swapdup(PTE2SLOT(*pte));
+        ptset(npte, *pte);
+      }
+      continue;
+    }
+    // the child shares a whole megapage, as a megapage.
+    if(mega){
+      if(i % MEGAPGSIZE == 0 && end - i >= MEGAPGSIZE)
+        size = MEGAPGSIZE;
+      else if((pte = walk(old, i, 0)) == 0)
+        goto err;
+    }
 
-    // set PTE_COW and clear PTE_W
-    if ((*pte & PTE_W) != 0) {
+    // set PTE_COW and clear PTE_W. a PTE in a shared leaf
+    // table is never writable, so this doesn't change one.
+    if (!share && (*pte & PTE_W) != 0) {
       *pte = *pte | PTE_COW;
+      *pte = *pte & ~PTE_W;
     }
-    *pte = *pte & ~PTE_W;
 
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
+    if (flags & PTE_COW)
+      for (uint64 off = 0; off < size; off += PGSIZE)
+        kpageset((void*) (pa + off), PG_COW);
 
     // child pagetable points to the same RO page
-    if(mappages(new, i, PGSIZE, pa, flags) != 0){
+    if(mappages(new, i, size, pa, flags) != 0){
       goto err;
     }
   }
+  // the parent's writable entries are now read-only.
+  if(!share)
+    tlbflush(old, start, (end - start) / PGSIZE);
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  if(!share)
+    tlbflush(old, start, (end - start) / PGSIZE);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
+  return -1;
+}
+
+// Allocate the page-table pages for heap growth from oldsz to
+// newsz, so that faulting in a page later needs only the page.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmreserve(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
+{
+  pte_t *pte;
+  uint64 a;
+
+  // one page-table page maps each 2 MB. one that fork() shared
+  // is left shared until it's written.
+  for(a = PGROUNDUP(oldsz); a < newsz; a = (a | ((PGSIZE << 9) - 1)) + 1){
+    if((pte = walklevel(pagetable, a, 1, 1)) == 0)
+      return -1;
+    if((*pte & PTE_V) == 0 && walk(pagetable, a, 1) == 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Map a new zeroed megapage at va, which must have nothing
+// mapped in its 2 MB. Returns 0 on success, -1 if something is
+// mapped or no megapage is free.
+static int
+uvmmega(pagetable_t pagetable, uint64 va)
+{
+  pagetable_t pt = 0;
+  pte_t *pte;
+  char *mem;
+
+  if((pte = walklevel(pagetable, va, 1, 1)) == 0)
+    return -1;
+  if(*pte & PTE_V){
+    // uvmreserve() allocated the page-table page; it must be
+    // empty, with nothing on swap either, and so not shared.
+    pt = (pagetable_t)PTE2PA(*pte);
+    if(knumreference(pt) != 1 || kptes(pt, 0) != 0)
+      return -1;
+  }
+  if((mem = kalloc_pages(MEGAORDER)) == 0)
+    return -1;
+  memset(mem, 0, MEGAPGSIZE);
+
+  if(pt){
+    ptset(pte, 0);
+    // the TLB may still cache the old page-table page.
+    tlbflush(pagetable, va, MEGAPGSIZE / PGSIZE);
+    kfree(pt);
+  }
+  if(mappages(pagetable, va, MEGAPGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0)
+    panic("uvmmega");
+  return 0;
+}
+
+// Resolve a write to the copy-on-write megapage leaf *pte. If no
+// one else maps any of its pages, it just becomes writable again.
+// Otherwise it is copied to a new megapage or, if none is free,
+// split so that a later fault copies just the page written.
+// Returns 1 if it copied, 0 if not, -1 if out of memory.
+static int
+cowmega(pagetable_t pagetable, uint64 va, pte_t *pte)
+{
+  uint64 pa = PTE2PA(*pte);
+  uint flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+  char *mem;
+  int i;
+
+  // the kernel's direct map holds one reference to every page.
+  for(i = 0; i < 512; i++)
+    if(knumreference((void*)(pa + i*PGSIZE)) != 2)
+      break;
+  if(i == 512){
+    for(i = 0; i < 512; i++)
+      kpageclear((void*)(pa + i*PGSIZE), PG_COW);
+    *pte = PA2PTE(pa) | flags;
+    tlbflush(pagetable, MEGAPGROUNDDOWN(va), MEGAPGSIZE / PGSIZE);
+    return 0;
+  }
+
+  if((mem = kalloc_pages(MEGAORDER)) == 0)
+    return splitmega(pte);
+  memmove(mem, (void*)pa, MEGAPGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  tlbflush(pagetable, MEGAPGROUNDDOWN(va), MEGAPGSIZE / PGSIZE);
+  megaunref(pa, 1);
+  megaref((uint64)mem);
+  return 1;
+}
+
+// Resolve a write to the copy-on-write page at va. If no other
+// page table maps it, it just becomes writable again; otherwise
+// it's copied and the copy mapped writable in its place.
+// Returns 1 if it copied, 0 if not, -1 if out of memory.
+static int
+cowpage(pagetable_t pagetable, uint64 va)
+{
+  uint64 pa;
+  uint flags;
+  pte_t *pte;
+  char *mem;
+
+  // unshares the leaf page-table page, so that the page's
+  // count is of page tables that map it.
+  if((pte = walk(pagetable, va, 0)) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+
+  if(knumreference((void*)pa) == 2 && !kpageflags((void*)pa, PG_PINNED)){
+    kpageclear((void*)pa, PG_COW);
+    *pte = PA2PTE(pa) | flags;
+    tlbflush(pagetable, va, 1);
+    return 0;
+  }
+
+  // a copy of the zero page needs no copying.
+  if(kpageflags((void*)pa, PG_ZEROED)){
+    if((mem = kalloc_zeroed()) == 0)
+      return -1;
+  } else {
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, (void*)pa, PGSIZE);
+  }
+  kreference(mem);
+  *pte = PA2PTE(mem) | flags;
+  tlbflush(pagetable, va, 1);
+  if(kdereference((void*)pa) == 1)
+    kfree((void*)pa);
+  return 1;
+}
+
+// Resolve a write to the copy-on-write user page at va. After
+// writes to consecutive pages, the next COWBATCH pages that are
+// copy-on-write in the same leaf table are resolved too, saving
+// the faults a sequential write would take on them.
+// Returns 0 on success, -1 if va isn't copy-on-write or memory
+// ran out.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  int mega, n, r;
+
+  // only count p's own faults, not e.g. fork()'s.
+  if(p && p->pagetable != pagetable)
+    p = 0;
+
+  va = PGROUNDDOWN(va);
+  if(va >= MAXVA || (pte = walkleaf(pagetable, va, &mega)) == 0 ||
+     (*pte & (PTE_U | PTE_COW)) != (PTE_U | PTE_COW))
+    return -1;
+  if(p)
+    p->cowfaults++;
+
+  if(mega){
+    if((r = cowmega(pagetable, va, pte)) < 0)
+      return -1;
+    if(p)
+      p->cowcopies += r;
+    return 0;
+  }
+
+  n = (p && va == p->cowlast + PGSIZE) ? COWBATCH : 1;
+  for(int i = 0; i < n; i++, va += PGSIZE){
+    if(i > 0){
+      if(va % MEGAPGSIZE == 0 || va >= MAXVA)
+        break;
+      if((pte = walkleaf(pagetable, va, &mega)) == 0 || (*pte & PTE_COW) == 0)
+        break;
+    }
+    if((r = cowpage(pagetable, va)) < 0){
+      if(i == 0)
+        return -1;
+      break;
+    }
+    if(p){
+      p->cowcopies += r;
+      p->cowlast = va;
+    }
+  }
+  return 0;
+}
+
+// Fault in p's page at va, which has no valid PTE: from swap,
+// from the program file, as a new heap page, or from a mapping.
+// A page on swap, or of the program, that can't be read in is
+// an error, rather than a page to fill some other way.
+// Returns 0 on success, -1 if va can't be faulted in.
+int
+uvmfaultin(struct proc *p, uint64 va, int write)
+{
+  int r;
+
+  if((r = swapin(p, va)) <= 0)
+    return r;
+  if((r = execfault(p, va)) <= 0)
+    return r;
+  if(uvmlazy(p->pagetable, va, p->sz, write) == 0 || mmapfault(p, va, write) == 0)
+    return 0;
   return -1;
 }
 
+// Fault in the heap page at va of a process of size sz, which
+// sbrk() reserved but nothing has touched yet. A read maps the
+// shared zero page copy-on-write; a write maps a new zeroed page.
+// Returns 0 on success, -1 if va is not such a page or memory
+// ran out.
+int
+uvmlazy(pagetable_t pagetable, uint64 va, uint64 sz, int write)
+{
+  char *mem;
+  int mega;
+
+  va = PGROUNDDOWN(va);
+  if(va >= sz || va >= MAXVA)
+    return -1;
+  // a page on swap isn't untouched, even if swapin() failed.
+  if(walkleaf(pagetable, va, &mega) != 0 || walkswap(pagetable, va) != 0)
+    return -1;
+
+  // the first write to an untouched, 2 MB-aligned stretch of
+  // heap gets a megapage, if one is free.
+  if(write && MEGAPGROUNDDOWN(va) + MEGAPGSIZE <= sz &&
+     uvmmega(pagetable, MEGAPGROUNDDOWN(va)) == 0)
+    return 0;
+
+  if(!write)
+    return mappages(pagetable, va, PGSIZE, (uint64)zeropage, PTE_R|PTE_U|PTE_COW);
+
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
 // mark a PTE invalid for user access.
-// used by exec for the user stack guard page.
+// used by exec for the user stack guard page. the kernel could
+// still read it through the process's kernel page table, so
+// udirect() leaves copies that touch it to uaccess_addr().
 void
 uvmclear(pagetable_t pagetable, uint64 va)
 {
@@ -375,129 +1271,258 @@ uvmclear(pagetable_t pagetable, uint64 va)
   pte = walk(pagetable, va, 0);
   if(pte == 0)
     panic("uvmclear");
-  *pte &= ~PTE_U;
+  // not PTE_W either, so that ucopy() can't write it.
+  *pte &= ~(PTE_U | PTE_W);
 }
 
-// Copy from kernel to user.
-// Copy len bytes from src to virtual address dstva in a given page table.
-// Return 0 on success, -1 on error.
-int
-copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+// Start a cursor over pagetable's user memory.
+void
+uaccess_init(struct uaccess *ua, pagetable_t pagetable)
+{
+  ua->pagetable = pagetable;
+  ua->va = -1;
+  ua->pa = 0;
+  ua->write = 0;
+  ua->leaf = 0;
+}
+
+// Translate user page va0 the slow way: a page of the current
+// process that is on swap, or a program, heap or mmap() page that
+// hasn't been touched yet, is faulted in, unless a spinlock is
+// held, and a copy-on-write page is resolved for a write.
+// Returns the leaf PTE, or 0 if va0 can't be accessed.
+static pte_t *
+uaccess_fault(struct uaccess *ua, uint64 va0, int write, int *mega)
 {
   struct proc *p = myproc();
   pte_t *pte;
-  uint64 n, va0, pa0;
-  uint flags;
 
-  while(len > 0){
-    va0 = PGROUNDDOWN(dstva);
-    if (va0 >= MAXVA) {
-      return -1;
-    }
-    pte = walk(pagetable, va0, 0);
-    if (pte == 0) {
-      return -1;
-    }
-    flags = PTE_FLAGS(*pte);
-    pa0 = PTE2PA(*pte);
-    
-    // handle COW
-    if ((flags & PTE_COW) != 0) {
-      flags = (flags | PTE_W) & ~PTE_COW;
-      char *mem = kalloc();
-      if (mem == 0) {
-        setkilled(p);
-        return -1;
-      }
-      memmove(mem, (void*)pa0, PGSIZE);
-      uvmunmap(pagetable, va0, 1, 1);
-      if (mappages(pagetable, va0, PGSIZE, (uint64)mem, flags) != 0) {
+  if(va0 >= MAXVA)
+    return 0;
+  for(;;){
+    pte = walkleaf(ua->pagetable, va0, mega);
+    if(pte == 0 && p && ua->pagetable == p->pagetable && !holdingspin() &&
+       uvmfaultin(p, va0, write) == 0)
+      pte = walkleaf(ua->pagetable, va0, mega);
+    if(pte == 0 || (*pte & PTE_U) == 0)
+      return 0;
+    if(!write)
+      return pte;
+    if((*pte & (PTE_W | PTE_COW)) == 0)
+      return 0;
+    if((*pte & PTE_COW) == 0)
+      return pte;
+    if(uvmcow(ua->pagetable, va0) != 0){
+      if(p)
         setkilled(p);
-        return -1;
-      }
-      pa0 = (uint64)mem;
+      return 0;
     }
+    // look again: the page is writable, or a megapage split.
+  }
+}
+
+// Return the kernel address of user byte va, for reading or
+// writing it and the rest of its page; 0 if it can't be.
+uint64
+uaccess_addr(struct uaccess *ua, uint64 va, int write)
+{
+  uint64 va0 = PGROUNDDOWN(va);
+  pte_t *pte;
+  int mega;
+
+  if(va0 == ua->va && (ua->write || !write))
+    return ua->pa + (va - va0);
+
+  // the next page of the same leaf table needs no walk, if it's
+  // already mapped the way we want it.
+  pte = 0;
+  if(ua->leaf && va0 == ua->va + PGSIZE && va0 % MEGAPGSIZE != 0){
+    pte = &ua->leaf[PX(0, va0)];
+    if((*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U) || (write && (*pte & PTE_W) == 0))
+      pte = 0;
+  }
+  mega = 0;
+  if(pte == 0 && (pte = uaccess_fault(ua, va0, write, &mega)) == 0){
+    ua->va = -1;
+    ua->leaf = 0;
+    return 0;
+  }
 
-    if(pa0 == 0)
+  // so that munmap() writes a shared file page back.
+  if(write)
+    *pte |= PTE_D;
+  ua->va = va0;
+  ua->pa = PTE2PA(*pte);
+  ua->write = write;
+  ua->leaf = 0;
+  if(mega)
+    ua->pa += va0 & (MEGAPGSIZE-1);
+  else
+    ua->leaf = (pagetable_t)PGROUNDDOWN((uint64)pte);
+  return ua->pa + (va - va0);
+}
+
+// Fault in the current process's pages in [va, va+len), for
+// writing if write is set, so that copying to or from them with
+// a spinlock held needn't sleep in swapin() or execfault(). Such
+// a copy fails, rather than sleep, on a page that isn't in (see
+// kerneltrap()), so every caller that holds one must touch the
+// pages first. The pages stay in until the process next sleeps.
+// Returns 0, or -1 if a page can't be faulted in; the caller
+// then fails the read or write without making the copy.
+int
+uaccess_touch(uint64 va, uint64 len, int write)
+{
+  struct uaccess ua;
+
+  uaccess_init(&ua, myproc()->pagetable);
+  for(uint64 a = va; a < va + len; a = PGROUNDDOWN(a) + PGSIZE)
+    if(uaccess_addr(&ua, a, write) == 0)
+      return -1;
+  return 0;
+}
+
+// True if [va, va+len) of pagetable can be reached directly, in
+// the current process's kernel page table, where the stack guard
+// page is readable.
+static int
+udirect(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+
+  return p && p->pagetable == pagetable && va + len >= va && va + len <= PLIC &&
+         (va >= p->guard + PGSIZE || va + len <= p->guard);
+}
+
+// Copy len bytes from src to user address dstva.
+// Return 0 on success, -1 on error.
+int
+uaccess_copyout(struct uaccess *ua, uint64 dstva, char *src, uint64 len)
+{
+  uint64 n, pa;
+
+  if(udirect(ua->pagetable, dstva, len))
+    return ucopy((void *)dstva, src, len);
+
+  while(len > 0){
+    if((pa = uaccess_addr(ua, dstva, 1)) == 0)
       return -1;
-    n = PGSIZE - (dstva - va0);
+    n = PGSIZE - (dstva % PGSIZE);
     if(n > len)
       n = len;
-    memmove((void *)(pa0 + (dstva - va0)), src, n);
+    memmove((void *)pa, src, n);
 
     len -= n;
     src += n;
-    dstva = va0 + PGSIZE;
+    dstva += n;
   }
   return 0;
 }
 
-// Copy from user to kernel.
-// Copy len bytes to dst from virtual address srcva in a given page table.
+// Copy len bytes to dst from user address srcva.
 // Return 0 on success, -1 on error.
 int
-copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+uaccess_copyin(struct uaccess *ua, char *dst, uint64 srcva, uint64 len)
 {
-  uint64 n, va0, pa0;
-  
+  uint64 n, pa;
+
+  if(udirect(ua->pagetable, srcva, len))
+    return ucopy(dst, (void *)srcva, len);
+
   while(len > 0){
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa = uaccess_addr(ua, srcva, 0)) == 0)
       return -1;
-    n = PGSIZE - (srcva - va0);
+    n = PGSIZE - (srcva % PGSIZE);
     if(n > len)
       n = len;
-    memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    memmove(dst, (void *)pa, n);
 
     len -= n;
     dst += n;
-    srcva = va0 + PGSIZE;
+    srcva += n;
   }
   return 0;
 }
 
-// Copy a null-terminated string from user to kernel.
-// Copy bytes to dst from virtual address srcva in a given page table,
-// until a '\0', or max.
+// true if one of the 8 bytes of v is zero.
+#define HASZERO(v) (((v) - 0x0101010101010101UL) & ~(v) & 0x8080808080808080UL)
+
+// Copy a null-terminated string to dst from user address srcva,
+// until a '\0', or max bytes. Aligned words are copied whole
+// until one holds the '\0'.
 // Return 0 on success, -1 on error.
 int
-copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
+uaccess_copyinstr(struct uaccess *ua, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
-  int got_null = 0;
+  uint64 n, i, w;
+  char *s;
+
+  if(udirect(ua->pagetable, srcva, max))
+    return ucopystr(dst, (void *)srcva, max);
 
-  while(got_null == 0 && max > 0){
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+  while(max > 0){
+    if((s = (char *)uaccess_addr(ua, srcva, 0)) == 0)
       return -1;
-    n = PGSIZE - (srcva - va0);
+    n = PGSIZE - (srcva % PGSIZE);
     if(n > max)
       n = max;
 
-    char *p = (char *) (pa0 + (srcva - va0));
-    while(n > 0){
-      if(*p == '\0'){
-        *dst = '\0';
-        got_null = 1;
-        break;
-      } else {
-        *dst = *p;
+    for(i = 0; i < n; ){
+      if(n - i >= 8 && ((uint64)(s + i) & 7) == 0 && ((uint64)(dst + i) & 7) == 0){
+        w = *(uint64 *)(s + i);
+        if(!HASZERO(w)){
+          *(uint64 *)(dst + i) = w;
+          i += 8;
+          continue;
+        }
       }
-      --n;
-      --max;
-      p++;
-      dst++;
+      if((dst[i] = s[i]) == '\0')
+        return 0;
+      i++;
     }
 
-    srcva = va0 + PGSIZE;
-  }
-  if(got_null){
-    return 0;
-  } else {
-    return -1;
+    max -= n;
+    dst += n;
+    srcva += n;
   }
+  return -1;
+}
+
+// Copy from kernel to user.
+// Copy len bytes from src to virtual address dstva in a given page table.
+// Return 0 on success, -1 on error.
+int
+copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+{
+  struct uaccess ua;
+
+  uaccess_init(&ua, pagetable);
+  return uaccess_copyout(&ua, dstva, src, len);
+}
+
+// Copy from user to kernel.
+// Copy len bytes to dst from virtual address srcva in a given page table.
+// Return 0 on success, -1 on error.
+int
+copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+{
+  struct uaccess ua;
+
+  uaccess_init(&ua, pagetable);
+  return uaccess_copyin(&ua, dst, srcva, len);
+}
+
+// Copy a null-terminated string from user to kernel.
+// Copy bytes to dst from virtual address srcva in a given page table,
+// until a '\0', or max.
+// Return 0 on success, -1 on error.
+int
+copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
+{
+  struct uaccess ua;
+
+  uaccess_init(&ua, pagetable);
+  return uaccess_copyinstr(&ua, dst, srcva, max);
 }
 
 /**
@@ -523,7 +1548,8 @@ void vmprintl(pagetable_t pagetable, int level)
       }
     }
     printf("%d: pte %p pa %p\n", idx, pte, PTE2PA(pte));
-    vmprintl((pagetable_t) PTE2PA(pte), level + 1);
+    if (!PTE_LEAF(pte))
+      vmprintl((pagetable_t) PTE2PA(pte), level + 1);
   }
 }
 
@@ -563,3 +1589,94 @@ int pgaccess(pagetable_t pagetable, uint64 va, int len, uint64 mask) {
   return 0;
 }
 #endif
+
+// Report which of the npages user pages of p from va have been
+// used and written, one bit per page in the bitmaps at abits and
+// dbits, and clear the PTE_A and PTE_D bits that flags ask for
+// as they're read, so that a bit set between the read and the
+// clear isn't lost. Leaf tables are looked up once per 2 MB. A
+// page that isn't in memory reads as neither; a megapage's bits
+// are those of all its pages.
+//
+// PTE_D is only cleared where nothing else relies on it: in
+// memory below p->sz, which munmap() never writes back, and on
+// a page that only this page table maps, so that swapone()
+// isn't writing it out. Its copy on swap, if any, is dropped.
+// Nothing is cleared in a leaf table that fork() still shares.
+// Returns 0, or -1 if the range or a bitmap is bad.
+int
+pgstate(struct proc *p, uint64 va, int npages, uint64 abits, uint64 dbits, int flags)
+{
+  uchar a[512/8], d[512/8];
+  pagetable_t pt = 0;
+  pte_t *l1, *pte, clear, old, mega = 0;
+  uint64 start, pa;
+  int n, shared = 0, flush;
+
+  va = PGROUNDDOWN(va);
+  if(npages < 0 || va >= MAXVA || npages > (MAXVA - va) / PGSIZE)
+    return -1;
+  for(int done = 0; done < npages; done += n){
+    n = npages - done < 512 ? npages - done : 512;
+    memset(a, 0, sizeof(a));
+    memset(d, 0, sizeof(d));
+    start = va;
+    flush = 0;
+    for(int i = 0; i < n; i++, va += PGSIZE){
+      if(i == 0 || va % MEGAPGSIZE == 0){
+        pt = 0;
+        mega = 0;
+        l1 = walkl1(p->pagetable, va);
+        if(l1 == 0 || (*l1 & PTE_V) == 0){
+          ;
+        } else if(PTE_LEAF(*l1)){
+          if((*l1 & PTE_U) == 0)
+            continue;
+          clear = flags & PGS_CLEARA ? PTE_A : 0;
+          if((flags & PGS_CLEARD) && va < p->sz)
+            clear |= PTE_D;
+          mega = clear ? __sync_fetch_and_and(l1, ~clear) : *l1;
+          flush |= (mega & clear) != 0;
+        } else {
+          pt = (pagetable_t)PTE2PA(*l1);
+          shared = knumreference(pt) != 1;
+        }
+      }
+
+      if(mega){
+        old = mega;
+      } else if(pt){
+        pte = &pt[PX(0, va)];
+        if((*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U))
+          continue;
+        pa = PTE2PA(*pte);
+        clear = 0;
+        if(!shared && (flags & PGS_CLEARA))
+          clear |= PTE_A;
+        // the kernel's direct map holds one reference.
+        if(!shared && (flags & PGS_CLEARD) && va < p->sz && knumreference((void*)pa) == 2)
+          clear |= PTE_D;
+        old = clear ? __sync_fetch_and_and(pte, ~clear) : *pte;
+        flush |= (old & clear) != 0;
+        // the copy on swap was stale already if the page is dirty.
+        if((old & clear & PTE_D) && kswapslot((void*)pa) >= 0){
+          swapfree(kswapslot((void*)pa));
+          ksetswapslot((void*)pa, -1);
+        }
+      } else {
+        continue;
+      }
+      if(old & PTE_A)
+        a[i/8] |= 1 << (i%8);
+      if(old & PTE_D)
+        d[i/8] |= 1 << (i%8);
+    }
+    if(flush)
+      tlbflush(p->pagetable, start, n);
+
+    if(copyout(p->pagetable, abits + done/8, (char*)a, (n+7)/8) < 0 ||
+       copyout(p->pagetable, dbits + done/8, (char*)d, (n+7)/8) < 0)
+      return -1;
+  }
+  return 0;
+}
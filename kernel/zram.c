@@ -0,0 +1,263 @@
+// Compressed swap store.
+//
+// swapout() first tries to keep a page it evicts here, in kernel
+// memory, compressed by a small LZ77 compressor in the style of
+// LZ4; only a page that doesn't compress to half its size goes
+// to disk. Reading a compressed page back in takes a
+// decompression rather than a disk read, so memory that
+// compresses well -- zeroed buffers, tables, most text -- pages
+// out and in cheaply.
+//
+// A compressed page is kept in a slab cache object of the
+// smallest of a few sizes that holds it. Like a disk slot, an
+// entry has a reference for each swap PTE that holds it; the
+// last one frees it. swap.c tells entries from disk slots by
+// their number: entry i is slot ZSLOT + i.
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "defs.h"
+
+#define ZMAXLEN (PGSIZE / 2)  // longest compressed page worth keeping
+#define NZCLASS 5
+
+static uint zsize[NZCLASS] = { 64, 256, 512, 1024, ZMAXLEN };
+static struct kmem_cache *zcache[NZCLASS];
+
+struct zpage {
+  int ref;        // swap PTEs that hold it; free if 0
+  int class;      // index into zsize[] and zcache[]
+  int len;        // compressed bytes
+  uchar *data;
+};
+
+static struct spinlock zlock;
+static struct zpage zpage[NZPAGE];
+static int znext;           // where to look for a free entry
+static int nzpage;          // entries in use
+static uint64 nzbyte;       // bytes of slab objects they take
+
+// the compressor's scratch space. swapout() makes one zramput()
+// call at a time, so it needs no lock.
+#define LZHASHBITS 12
+static ushort lzhash[1 << LZHASHBITS];  // 1 + last position of each hash, or 0
+static uchar zbuf[ZMAXLEN];
+
+void
+zraminit(void)
+{
+  initlock(&zlock, "zram");
+  for(int c = 0; c < NZCLASS; c++)
+    zcache[c] = kmem_cache_create("zram", zsize[c], 0);
+}
+
+static uint
+lzh(uchar *p)
+{
+  uint v = p[0] | p[1] << 8 | p[2] << 16 | (uint)p[3] << 24;
+
+  return (v * 2654435761U) >> (32 - LZHASHBITS);
+}
+
+// Append length n to dst at op as a run of 255s and a last byte
+// below 255. Returns the new end.
+static int
+lzputlen(uchar *dst, int op, int n)
+{
+  for(; n >= 255; n -= 255)
+    dst[op++] = 255;
+  dst[op++] = n;
+  return op;
+}
+
+static int
+lzgetlen(uchar *src, int *ip)
+{
+  int n = 0;
+  uchar b;
+
+  do {
+    b = src[(*ip)++];
+    n += b;
+  } while(b == 255);
+  return n;
+}
+
+// Append a sequence to dst at op: a token with the two lengths,
+// nlit literal bytes from lit, and, if len > 0, a match of len
+// bytes that starts off bytes back. Returns the new end, or -1
+// if it would pass max.
+static int
+lzemit(uchar *dst, int op, int max, uchar *lit, int nlit, int off, int len)
+{
+  int m = len > 0 ? len - 4 : 0;
+
+  if(op + 1 + nlit/255 + 1 + nlit + 2 + m/255 + 1 > max)
+    return -1;
+  dst[op++] = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+  if(nlit >= 15)
+    op = lzputlen(dst, op, nlit - 15);
+  memmove(dst + op, lit, nlit);
+  op += nlit;
+  if(len > 0){
+    dst[op++] = off;
+    dst[op++] = off >> 8;
+    if(m >= 15)
+      op = lzputlen(dst, op, m - 15);
+  }
+  return op;
+}
+
+// Compress the page at src into dst. Returns the compressed
+// length, or 0 if it would be more than max bytes.
+static int
+lzcompress(uchar *src, uchar *dst, int max)
+{
+  int ip = 0, anchor = 0, op = 0, ref, len;
+  uint h;
+
+  memset(lzhash, 0, sizeof(lzhash));
+  while(ip + 4 <= PGSIZE){
+    h = lzh(src + ip);
+    ref = lzhash[h] - 1;
+    lzhash[h] = ip + 1;
+    if(ref < 0 || memcmp(src + ref, src + ip, 4) != 0){
+      ip++;
+      continue;
+    }
+    len = 4;
+    while(ip + len < PGSIZE && src[ref + len] == src[ip + len])
+      len++;
+    if((op = lzemit(dst, op, max, src + anchor, ip - anchor, ip - ref, len)) < 0)
+      return 0;
+    ip += len;
+    anchor = ip;
+  }
+  // the sequence with the last literals has no match.
+  if((op = lzemit(dst, op, max, src + anchor, PGSIZE - anchor, 0, 0)) < 0)
+    return 0;
+  return op;
+}
+
+// Decompress the n bytes at src into the page at dst.
+static void
+lzdecompress(uchar *src, int n, uchar *dst)
+{
+  int ip = 0, op = 0, nlit, len, off;
+  uchar t;
+
+  for(;;){
+    t = src[ip++];
+    nlit = t >> 4;
+    if(nlit == 15)
+      nlit += lzgetlen(src, &ip);
+    if(op + nlit > PGSIZE || ip + nlit > n)
+      panic("lzdecompress");
+    memmove(dst + op, src + ip, nlit);
+    ip += nlit;
+    op += nlit;
+    if(op == PGSIZE)
+      return;
+
+    off = src[ip] | src[ip+1] << 8;
+    ip += 2;
+    len = t & 15;
+    if(len == 15)
+      len += lzgetlen(src, &ip);
+    len += 4;
+    if(off == 0 || off > op || op + len > PGSIZE)
+      panic("lzdecompress");
+    // the match may overlap what it copies.
+    for(; len > 0; len--, op++)
+      dst[op] = dst[op - off];
+  }
+}
+
+// Store a compressed copy of page pa. Returns its entry, with
+// one reference, or -1 if the page doesn't compress well enough
+// or there is no room.
+int
+zramput(char *pa)
+{
+  uchar *data;
+  int n, c, i;
+
+  if((n = lzcompress((uchar*)pa, zbuf, ZMAXLEN)) == 0)
+    return -1;
+  for(c = 0; zsize[c] < n; c++)
+    ;
+  if((data = kmem_cache_alloc(zcache[c])) == 0)
+    return -1;
+  memmove(data, zbuf, n);
+
+  acquire(&zlock);
+  for(int j = 0; j < NZPAGE; j++){
+    i = (znext + j) % NZPAGE;
+    if(zpage[i].ref == 0){
+      zpage[i].ref = 1;
+      zpage[i].class = c;
+      zpage[i].len = n;
+      zpage[i].data = data;
+      znext = (i + 1) % NZPAGE;
+      nzpage++;
+      nzbyte += zsize[c];
+      release(&zlock);
+      return i;
+    }
+  }
+  release(&zlock);
+  kmem_cache_free(zcache[c], data);
+  return -1;
+}
+
+// Decompress entry i into the page at pa. The caller holds a
+// reference to i, so it can't change.
+void
+zramget(int i, char *pa)
+{
+  if(i < 0 || i >= NZPAGE || zpage[i].ref == 0)
+    panic("zramget");
+  lzdecompress(zpage[i].data, zpage[i].len, (uchar*)pa);
+}
+
+// Add a reference to entry i.
+void
+zramdup(int i)
+{
+  acquire(&zlock);
+  if(i < 0 || i >= NZPAGE || zpage[i].ref == 0)
+    panic("zramdup");
+  zpage[i].ref++;
+  release(&zlock);
+}
+
+// Drop a reference to entry i.
+void
+zramfree(int i)
+{
+  struct zpage *z;
+
+  if(i < 0 || i >= NZPAGE)
+    panic("zramfree");
+  z = &zpage[i];
+  acquire(&zlock);
+  if(z->ref == 0)
+    panic("zramfree");
+  if(--z->ref == 0){
+    kmem_cache_free(zcache[z->class], z->data);
+    z->data = 0;
+    nzpage--;
+    nzbyte -= zsize[z->class];
+  }
+  release(&zlock);
+}
+
+// Report the number of pages stored and the bytes they take.
+void
+zramstats(uint64 *npage, uint64 *nbyte)
+{
+  *npage = lockfree_read4(&nzpage);
+  *nbyte = lockfree_read8(&nzbyte);
+}
@@ -3,7 +3,9 @@
 //
 
 #include "kernel/types.h"
+#include "kernel/param.h"
 #include "kernel/memlayout.h"
+#include "kernel/sysinfo.h"
 #include "user/user.h"
 
 // allocate more than half of physical memory,
@@ -178,6 +180,75 @@ filetest()
   printf("ok\n");
 }
 
+// a page no one else maps is written without a copy, and
+// sequential writes to shared pages take fewer faults than pages.
+void
+counttest()
+{
+  int npage = 64, xstatus;
+  struct sysinfo info, info2;
+  char *p;
+
+  printf("count: ");
+
+  p = sbrk(npage * 4096);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("sbrk(%d) failed\n", npage * 4096);
+    exit(-1);
+  }
+  for(int i = 0; i < npage; i++)
+    p[i * 4096] = i;
+
+  // once the child is gone, the parent is the only owner again.
+  if(fork() == 0)
+    exit(0);
+  wait(0);
+  sysinfo(&info);
+  for(int i = 0; i < npage; i++)
+    p[i * 4096] = i + 1;
+  sysinfo(&info2);
+  if(info2.cowfaults == info.cowfaults || info2.cowcopies != info.cowcopies){
+    printf("error: sole owner's page copied\n");
+    exit(1);
+  }
+
+  if(fork() == 0){
+    // the first call copies the stack page.
+    sysinfo(&info);
+    sysinfo(&info);
+    for(int i = 0; i < npage; i++)
+      p[i * 4096] = i + 2;
+    sysinfo(&info2);
+    if(info2.cowcopies - info.cowcopies != npage){
+      printf("error: %d pages copied, not %d\n",
+             (int)(info2.cowcopies - info.cowcopies), npage);
+      exit(1);
+    }
+    if(info2.cowfaults - info.cowfaults >= npage / 2){
+      printf("error: %d faults for %d sequential pages\n",
+             (int)(info2.cowfaults - info.cowfaults), npage);
+      exit(1);
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  for(int i = 0; i < npage; i++){
+    if(p[i * 4096] != (char)(i + 1)){
+      printf("error: child overwrote parent\n");
+      exit(1);
+    }
+  }
+
+  if(sbrk(-npage * 4096) == (char*)0xffffffffffffffffL){
+    printf("sbrk(-%d) failed\n", npage * 4096);
+    exit(-1);
+  }
+
+  printf("ok\n");
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -192,6 +263,8 @@ main(int argc, char *argv[])
 
   filetest();
 
+  counttest();
+
   printf("ALL COW TESTS PASSED\n");
 
   exit(0);
@@ -0,0 +1,152 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+// Check that a program's pages, read in from its file on first
+// touch or shared through the text cache, hold what they should,
+// then measure how long big programs take to start. Each is
+// spawn()ed and killed at once, so the time is mostly loading
+// it: all of it when exec() reads every segment up front, little
+// when the pages are read in as the program touches them.
+
+#define NSTART 20
+
+char *testname = "???";
+char buf[512];
+
+// initialized data, far enough apart to be on different pages.
+int data[3 * 1024] = { 1, [1024] = 2, [2048] = 3 };
+// zero-filled data.
+int bss[3 * 1024];
+
+void
+err(char *why)
+{
+  printf("execbench: %s failed: %s, pid=%d\n", testname, why, getpid());
+  exit(1);
+}
+
+void
+datatest(void)
+{
+  int xstatus;
+
+  testname = "data";
+  if(data[0] != 1 || data[1024] != 2 || data[2048] != 3 || data[2047] != 0)
+    err("wrong initialized data");
+  for(int i = 0; i < 3 * 1024; i++)
+    if(bss[i] != 0)
+      err("bss not zero");
+
+  // a child reads the pages the parent hasn't touched from the file.
+  data[1024] = 20;
+  if(fork() == 0){
+    if(data[0] != 1 || data[1024] != 20 || data[2048] != 3)
+      err("child sees wrong data");
+    data[2048] = 30;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  if(data[2048] != 3)
+    err("child's write seen by parent");
+
+  // program text can't be written.
+  if(fork() == 0){
+    *(volatile char *)err = 0;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1)
+    err("write to text not killed");
+  printf("execbench: %s OK\n", testname);
+}
+
+// copy file from to file to, opened with flags.
+void
+copy(char *from, char *to, int flags)
+{
+  int fd0, fd1, n;
+
+  if((fd0 = open(from, O_RDONLY)) < 0 || (fd1 = open(to, flags)) < 0)
+    err("open");
+  while((n = read(fd0, buf, sizeof(buf))) > 0)
+    if(write(fd1, buf, n) != n)
+      err("write");
+  close(fd0);
+  close(fd1);
+}
+
+// run "prog exit code" and return its exit status.
+int
+run(char *prog, char *code)
+{
+  char *argv[] = { prog, "exit", code, 0 };
+  int xstatus;
+
+  if(spawn(prog, argv, 0) < 0)
+    err("spawn");
+  wait(&xstatus);
+  return xstatus;
+}
+
+// a program's text pages come from the cache only until the
+// file is written.
+void
+texttest(void)
+{
+  char *f = "exectmp";
+
+  testname = "text";
+  // a running program can't be changed under it.
+  if(open("execbench", O_WRONLY) >= 0)
+    err("opened running program for writing");
+  copy("execbench", f, O_WRONLY | O_CREATE | O_TRUNC);
+  if(run(f, "3") != 3 || run(f, "4") != 4)
+    err("copy of execbench");
+  // forkbench with "exit" exits 0; writing, without truncating.
+  copy("forkbench", f, O_WRONLY);
+  if(run(f, "3") != 0)
+    err("ran stale text after write");
+  copy("execbench", f, O_WRONLY | O_TRUNC);
+  if(run(f, "5") != 5)
+    err("ran stale text after truncate");
+  unlink(f);
+  printf("execbench: %s OK\n", testname);
+}
+
+// spawn() prog n times, killing each child before it runs.
+// returns elapsed ticks.
+int
+startbench(char *prog, int n)
+{
+  char *argv[] = { prog, 0 };
+  int pid, t0 = uptime();
+
+  for(int i = 0; i < n; i++){
+    if((pid = spawn(prog, argv, 0)) < 0)
+      err("spawn");
+    kill(pid);
+    wait(0);
+  }
+  return uptime() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *progs[] = { "usertests", "grind" };
+
+  if(argc == 3 && strcmp(argv[1], "exit") == 0)
+    exit(atoi(argv[2]));
+
+  datatest();
+  texttest();
+  testname = "start";
+  for(int i = 0; i < 2; i++)
+    printf("execbench: %d starts of %s: %d ticks\n", NSTART, progs[i],
+           startbench(progs[i], NSTART));
+  exit(0);
+}
@@ -0,0 +1,134 @@
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+// Check that fork() keeps parent and child memory apart when
+// they share page-table pages, and measure fork()+exec() and
+// fork()+exit() as the parent's heap grows. With leaf page
+// tables shared copy-on-write, the times should barely depend
+// on the heap size. spawn(), which copies nothing, is the
+// baseline for fork()+exec().
+
+#define NFORK 100
+
+char *testname = "???";
+
+void
+err(char *why)
+{
+  printf("forkbench: %s failed: %s, pid=%d\n", testname, why, getpid());
+  exit(1);
+}
+
+// grow the heap by npage pages, mapped as 4 KB pages: a read
+// first maps the zero page, so no megapage is used.
+char *
+grow(int npage)
+{
+  char *a;
+
+  if((a = sbrk(npage * PGSIZE)) == (char *)-1)
+    err("sbrk");
+  for(int i = 0; i < npage; i++){
+    (void)*(volatile char *)(a + i * PGSIZE);
+    *(int *)(a + i * PGSIZE) = i;
+  }
+  return a;
+}
+
+void
+sharetest(void)
+{
+  int npage = 1024, xstatus, fds[2];
+  char *a, c;
+
+  testname = "share";
+  a = grow(npage);
+  if(pipe(fds) < 0)
+    err("pipe");
+
+  if(fork() == 0){
+    // wait for the parent to write after the fork.
+    if(read(fds[0], &c, 1) != 1)
+      err("read");
+    for(int i = 0; i < npage; i++)
+      if(*(int *)(a + i * PGSIZE) != i)
+        err("child sees parent's write");
+    for(int i = 0; i < npage; i += 3)
+      *(int *)(a + i * PGSIZE) = -i;
+    // shrinking into a shared table must not touch the parent's.
+    sbrk(-(npage / 2 * PGSIZE + 7 * PGSIZE));
+    exit(0);
+  }
+  for(int i = 0; i < npage; i += 2)
+    *(int *)(a + i * PGSIZE) = i + 1;
+  write(fds[1], "x", 1);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  for(int i = 0; i < npage; i++)
+    if(*(int *)(a + i * PGSIZE) != (i % 2 == 0 ? i + 1 : i))
+      err("parent sees child's write");
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-(npage * PGSIZE));
+  printf("forkbench: %s OK\n", testname);
+}
+
+// fork() n times; each child execs forkbench, which exits at
+// once, if doexec is set, or just exits. returns elapsed ticks.
+int
+bench(int n, int doexec)
+{
+  char *argv[] = { "forkbench", "exit", 0 };
+  int t0 = uptime();
+
+  for(int i = 0; i < n; i++){
+    int pid = fork();
+    if(pid < 0)
+      err("fork");
+    if(pid == 0){
+      if(doexec)
+        exec("forkbench", argv);
+      exit(0);
+    }
+    wait(0);
+  }
+  return uptime() - t0;
+}
+
+// spawn() forkbench n times. returns elapsed ticks.
+int
+spawnbench(int n)
+{
+  char *argv[] = { "forkbench", "exit", 0 };
+  int t0 = uptime();
+
+  for(int i = 0; i < n; i++){
+    if(spawn("forkbench", argv, 0) < 0)
+      err("spawn");
+    wait(0);
+  }
+  return uptime() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int sizes[] = { 0, 1024, 4096 };  // pages of heap
+  int grown = 0;
+
+  if(argc > 1 && strcmp(argv[1], "exit") == 0)
+    exit(0);
+
+  sharetest();
+
+  testname = "bench";
+  for(int i = 0; i < 3; i++){
+    grow(sizes[i] - grown);
+    grown = sizes[i];
+    printf("forkbench: %d KB heap: %d fork+exit %d ticks, fork+exec %d ticks, spawn %d ticks\n",
+           grown * 4, NFORK, bench(NFORK, 0), bench(NFORK, 1), spawnbench(NFORK));
+  }
+  exit(0);
+}
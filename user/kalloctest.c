@@ -0,0 +1,182 @@
+//
+// stress the physical page allocator from several processes
+// at once and check the kmem lock statistics for contention.
+//
+
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "kernel/memlayout.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define NCHILD 4
+#define N     100000
+#define NFORK 1000
+#define SZ    4096
+
+void test1(void);
+void test2(void);
+void test3(void);
+char buf[SZ];
+
+int
+main(int argc, char *argv[])
+{
+  test1();
+  test2();
+  test3();
+  exit(0);
+}
+
+// Parse the "tot=" line of the statistics device: the total
+// number of test-and-set spins on the locks statslock() sums.
+int ntas(int print)
+{
+  int n;
+  char *c;
+
+  if (statistics(buf, SZ) <= 0) {
+    fprintf(2, "ntas: no stats\n");
+    exit(1);
+  }
+  if((c = strchr(buf, '=')) == 0){
+    fprintf(2, "ntas: no total in stats\n");
+    exit(1);
+  }
+  n = atoi(c+2);
+  if(print)
+    printf("%s", buf);
+  return n;
+}
+
+// Wait for all NCHILD children, failing if any of them did.
+void
+waitall(char *name)
+{
+  int i, xstatus;
+
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: child failed\n", name);
+      exit(1);
+    }
+  }
+}
+
+// Every child repeatedly grows and shrinks its heap by one
+// page, so every iteration is one kalloc() and one kfree().
+void test1(void)
+{
+  void *a, *a1;
+  int n, m;
+
+  printf("start test1\n");
+  m = ntas(0);
+  for(int i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("fork failed");
+      exit(1);
+    }
+    if(pid == 0){
+      for(i = 0; i < N; i++) {
+        a = sbrk(4096);
+        *(int *)(a+4) = 1;
+        a1 = sbrk(-4096);
+        if (a1 != a + 4096) {
+          printf("wrong sbrk\n");
+          exit(1);
+        }
+      }
+      exit(0);
+    }
+  }
+  waitall("test1");
+  printf("test1 results:\n");
+  n = ntas(1);
+  if(n-m < 10) 
+    printf("test1 OK\n");
+  else
+    printf("test1 FAIL\n");
+}
+
+// Every child forks short-lived grandchildren that dirty
+// some copy-on-write pages, driving page-table, trapframe
+// and COW copy allocations on all CPUs at once.
+void test2(void)
+{
+  int n, m;
+  char *p;
+
+  printf("start test2\n");
+  m = ntas(0);
+  for(int i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("fork failed");
+      exit(1);
+    }
+    if(pid == 0){
+      p = sbrk(8 * PGSIZE);
+      if(p == (char*)-1)
+        exit(1);
+      for(int j = 0; j < NFORK; j++){
+        int pid1 = fork();
+        if(pid1 < 0)
+          exit(1);
+        if(pid1 == 0){
+          for(int k = 0; k < 8; k++)
+            p[k * PGSIZE] = k;
+          exit(0);
+        }
+        wait(0);
+      }
+      exit(0);
+    }
+  }
+  waitall("test2");
+  printf("test2 results:\n");
+  n = ntas(1);
+  if(n-m < 10 * NCHILD)
+    printf("test2 OK\n");
+  else
+    printf("test2 FAIL\n");
+}
+
+// Count free memory by allocating it all, twice, to check
+// that pages parked on other CPUs' lists can be stolen and
+// that none were lost by the earlier tests.
+int
+countfree()
+{
+  uint64 sz0 = (uint64)sbrk(0);
+  int n = 0;
+
+  while(1){
+    char *a = sbrk(PGSIZE);
+    if(a == (char*)0xffffffffffffffffL){
+      break;
+    }
+    *a = 1;
+    n += 1;
+  }
+  sbrk(-((uint64)sbrk(0) - sz0));
+  return n;
+}
+
+void test3(void)
+{
+  int free0, free1;
+
+  printf("start test3\n");
+  free0 = countfree();
+  free1 = countfree();
+  if(free1 < free0 - 32 || free0 < (PHYSTOP - KERNBASE) / PGSIZE / 2){
+    printf("test3 FAIL: free %d then %d pages\n", free0, free1);
+    exit(1);
+  }
+  printf("test3 OK\n");
+}
@@ -0,0 +1,122 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "kernel/sysinfo.h"
+#include "user/user.h"
+
+// Check same-page merging: children that each fill their own
+// memory with the same contents should come to share it, and
+// still see what they wrote, and only that, after writing to it.
+
+#define NCHILD 4
+#define NPAGE  64    // pages each child fills
+#define RATE   1024  // pages to scan per tick
+#define WAIT   200   // ticks to wait for the merging
+
+char *testname = "???";
+
+void
+err(char *why)
+{
+  printf("ksmtest: %s failed: %s, pid=%d\n", testname, why, getpid());
+  exit(1);
+}
+
+void
+info(struct sysinfo *si)
+{
+  if(sysinfo(si) < 0)
+    err("sysinfo");
+}
+
+// every word of page i holds i * 7 + 1, or -i once the child has
+// written to it.
+int
+check(char *p, int i, int val)
+{
+  int *w = (int *)(p + (uint64)i * PGSIZE);
+
+  for(int j = 0; j < PGSIZE / sizeof(int); j++)
+    if(w[j] != val)
+      return 0;
+  return 1;
+}
+
+// Fill NPAGE pages, wait for the parent to say go, check them,
+// write some of them, and check again.
+void
+child(int fd)
+{
+  char *p, c;
+  int *w;
+
+  if((p = sbrk(NPAGE * PGSIZE)) == (char *)-1)
+    err("sbrk");
+  for(int i = 0; i < NPAGE; i++){
+    w = (int *)(p + (uint64)i * PGSIZE);
+    for(int j = 0; j < PGSIZE / sizeof(int); j++)
+      w[j] = i * 7 + 1;
+  }
+  if(read(fd, &c, 1) != 1)
+    err("read");
+  for(int i = 0; i < NPAGE; i++)
+    if(!check(p, i, i * 7 + 1))
+      err("wrong data after merging");
+  for(int i = 0; i < NPAGE; i += 2)
+    *(int *)(p + (uint64)i * PGSIZE) = -i;
+  for(int i = 0; i < NPAGE; i++){
+    w = (int *)(p + (uint64)i * PGSIZE);
+    if(w[0] != (i % 2 == 0 ? -i : i * 7 + 1) || w[1] != i * 7 + 1)
+      err("wrong data after writing");
+  }
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct sysinfo si;
+  int fds[2], xstatus, old, t;
+
+  testname = "merge";
+  if(pipe(fds) < 0)
+    err("pipe");
+  for(int i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0)
+      err("fork");
+    if(pid == 0){
+      close(fds[1]);
+      child(fds[0]);
+    }
+  }
+  close(fds[0]);
+
+  // the children fill their pages and block in read().
+  old = ksm(RATE);
+  for(t = 0; t < WAIT; t += 10){
+    sleep(10);
+    info(&si);
+    if(si.ksmsaved >= (NCHILD - 1) * NPAGE)
+      break;
+  }
+  printf("ksmtest: %s: %d pages shared, %d saved after %d ticks\n",
+         testname, (int)si.ksmshared, (int)si.ksmsaved, t);
+  if(si.ksmsaved < (NCHILD - 1) * NPAGE / 2)
+    err("too few pages merged");
+  printf("ksmtest: %s OK\n", testname);
+
+  testname = "write";
+  for(int i = 0; i < NCHILD; i++)
+    if(write(fds[1], "x", 1) != 1)
+      err("write");
+  for(int i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+  close(fds[1]);
+  ksm(old);
+  printf("ksmtest: %s OK\n", testname);
+  exit(0);
+}
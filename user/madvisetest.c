@@ -0,0 +1,132 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "kernel/fcntl.h"
+#include "kernel/sysinfo.h"
+#include "user/user.h"
+
+// Check madvise(): dropped pages free their memory and read as
+// zero, or as the file; free() gives big blocks back; pages read
+// ahead or faulted in early hold the right data.
+
+#define NPAGE 256
+#define NFILEPG 32
+
+char *testname = "???";
+
+void
+err(char *why)
+{
+  printf("madvisetest: %s failed: %s, pid=%d\n", testname, why, getpid());
+  exit(1);
+}
+
+uint64
+freemem(void)
+{
+  struct sysinfo si;
+
+  if(sysinfo(&si) < 0)
+    err("sysinfo");
+  return si.freemem;
+}
+
+// make a file of NFILEPG pages, each filled with its number.
+void
+mkfile(char *f)
+{
+  char buf[PGSIZE];
+  int fd;
+
+  unlink(f);
+  if((fd = open(f, O_WRONLY | O_CREATE)) < 0)
+    err("create");
+  for(int i = 0; i < NFILEPG; i++){
+    memset(buf, 'a' + i, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf))
+      err("write");
+  }
+  close(fd);
+}
+
+int
+checkfile(char *p)
+{
+  for(int i = 0; i < NFILEPG; i++)
+    for(int j = 0; j < PGSIZE; j += 512)
+      if(p[i * PGSIZE + j] != 'a' + i)
+        return 0;
+  return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *p, *m;
+  uint64 before;
+  int fd;
+
+  testname = "dontneed";
+  if((p = sbrk(NPAGE * PGSIZE)) == (char *)-1)
+    err("sbrk");
+  for(int i = 0; i < NPAGE * PGSIZE; i += PGSIZE)
+    p[i] = 1;
+  before = freemem();
+  if(madvise(p, NPAGE * PGSIZE, MADV_DONTNEED) < 0)
+    err("madvise");
+  if(freemem() < before + NPAGE / 2 * PGSIZE)
+    err("memory not freed");
+  for(int i = 0; i < NPAGE * PGSIZE; i += PGSIZE)
+    if(p[i] != 0)
+      err("dropped page not zero");
+  printf("madvisetest: %s OK\n", testname);
+
+  testname = "free";
+  if((m = malloc(NPAGE * PGSIZE)) == 0)
+    err("malloc");
+  memset(m, 1, NPAGE * PGSIZE);
+  before = freemem();
+  free(m);
+  if(freemem() < before + NPAGE / 2 * PGSIZE)
+    err("free() kept the memory");
+  printf("madvisetest: %s OK\n", testname);
+
+  testname = "file";
+  mkfile("madvise.f");
+  if((fd = open("madvise.f", O_RDONLY)) < 0)
+    err("open");
+  m = mmap(0, NFILEPG * PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(m == (char *)-1)
+    err("mmap");
+  if(madvise(m, NFILEPG * PGSIZE, MADV_SEQUENTIAL) < 0)
+    err("madvise sequential");
+  if(!checkfile(m))
+    err("wrong data read ahead");
+  // a dropped page of a private file mapping reads from the file.
+  m[0] = 'z';
+  if(madvise(m, PGSIZE, MADV_DONTNEED) < 0 || m[0] != 'a')
+    err("dropped page not reread");
+  if(madvise(m, NFILEPG * PGSIZE, MADV_DONTNEED) < 0 ||
+     madvise(m, NFILEPG * PGSIZE, MADV_WILLNEED) < 0)
+    err("madvise willneed");
+  if(!checkfile(m))
+    err("wrong data faulted in early");
+  if(madvise(m, PGSIZE, MADV_FREE) != -1)
+    err("MADV_FREE allowed on a file");
+  if(madvise(m, PGSIZE, 99) != -1)
+    err("bad advice allowed");
+  // there is nothing mapped right below the mapping.
+  if(madvise(m - PGSIZE, PGSIZE, MADV_DONTNEED) != -1)
+    err("unmapped range allowed");
+  munmap(m, NFILEPG * PGSIZE);
+  close(fd);
+  unlink("madvise.f");
+  m = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(m == (char *)-1)
+    err("mmap");
+  if(madvise(m, PGSIZE, MADV_DONTNEED) != -1)
+    err("MADV_DONTNEED allowed on shared anonymous memory");
+  munmap(m, PGSIZE);
+  printf("madvisetest: %s OK\n", testname);
+  exit(0);
+}
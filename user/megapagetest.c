@@ -0,0 +1,156 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "kernel/sysinfo.h"
+#include "user/user.h"
+
+#define NMEGA 4  // megapages of heap to test with
+
+char *testname = "???";
+
+void
+err(char *why)
+{
+  printf("megapagetest: %s failed: %s, pid=%d\n", testname, why, getpid());
+  exit(1);
+}
+
+uint64
+freemem(void)
+{
+  struct sysinfo info;
+
+  if(sysinfo(&info) < 0)
+    err("sysinfo");
+  return info.freemem;
+}
+
+// grow the heap to a 2 MB boundary, then by n megapages.
+char *
+megasbrk(int n)
+{
+  uint64 top = (uint64)sbrk(0);
+  char *a;
+
+  if(sbrk(MEGAPGROUNDUP(top) - top) == (char *)-1)
+    err("sbrk");
+  if((a = sbrk(n * MEGAPGSIZE)) == (char *)-1)
+    err("sbrk");
+  return a;
+}
+
+void
+fill(char *a, uint64 n, int seed)
+{
+  for(uint64 i = 0; i < n; i += PGSIZE)
+    *(int *)(a + i) = seed + i / PGSIZE;
+}
+
+void
+check(char *a, uint64 n, int seed)
+{
+  for(uint64 i = 0; i < n; i += PGSIZE)
+    if(*(int *)(a + i) != seed + i / PGSIZE)
+      err("wrong data");
+}
+
+// the first write to an aligned 2 MB of heap maps a whole megapage.
+void
+promotetest(void)
+{
+  uint64 before, after;
+  char *a;
+
+  testname = "promote";
+  a = megasbrk(NMEGA);
+  before = freemem();
+  a[0] = 1;
+  after = freemem();
+  // the megapage replaces a page-table page sbrk() allocated.
+  if(before - after < MEGAPGSIZE - PGSIZE)
+    err("first write did not allocate a megapage");
+  fill(a, NMEGA * MEGAPGSIZE, 100);
+  check(a, NMEGA * MEGAPGSIZE, 100);
+  sbrk(-(NMEGA * MEGAPGSIZE));
+  if(freemem() < before)
+    err("megapages not freed");
+  printf("megapagetest: %s OK\n", testname);
+}
+
+// fork shares megapages copy-on-write.
+void
+forktest(void)
+{
+  int xstatus;
+  char *a;
+
+  testname = "fork";
+  a = megasbrk(NMEGA);
+  fill(a, NMEGA * MEGAPGSIZE, 200);
+
+  if(fork() == 0){
+    check(a, NMEGA * MEGAPGSIZE, 200);
+    // write one page in the middle of a megapage.
+    *(int *)(a + MEGAPGSIZE + 7 * PGSIZE) = -1;
+    *(int *)(a + MEGAPGSIZE + 7 * PGSIZE) = 200 + MEGAPGSIZE / PGSIZE + 7;
+    check(a, NMEGA * MEGAPGSIZE, 200);
+    fill(a, NMEGA * MEGAPGSIZE, 300);
+    check(a, NMEGA * MEGAPGSIZE, 300);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  check(a, NMEGA * MEGAPGSIZE, 200);
+  // now the only owner; writes need no copy.
+  fill(a, NMEGA * MEGAPGSIZE, 400);
+  check(a, NMEGA * MEGAPGSIZE, 400);
+  sbrk(-(NMEGA * MEGAPGSIZE));
+  printf("megapagetest: %s OK\n", testname);
+}
+
+// shrinking the heap into the middle of a megapage splits it.
+void
+splittest(void)
+{
+  int xstatus;
+  char *a, *top;
+
+  testname = "split";
+  a = megasbrk(2);
+  fill(a, 2 * MEGAPGSIZE, 500);
+  if(sbrk(-(MEGAPGSIZE + 10 * PGSIZE)) == (char *)-1)
+    err("sbrk shrink");
+  top = sbrk(0);
+  if(top != a + MEGAPGSIZE - 10 * PGSIZE)
+    err("wrong size");
+  check(a, MEGAPGSIZE - 10 * PGSIZE, 500);
+
+  if(fork() == 0){
+    *(volatile int *)top;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1)
+    err("read past sbrk not killed");
+
+  // memory handed out again is zero.
+  if(sbrk(10 * PGSIZE) == (char *)-1)
+    err("sbrk");
+  for(int i = 0; i < 10 * PGSIZE; i++)
+    if(top[i] != 0)
+      err("not zero");
+  check(a, MEGAPGSIZE - 10 * PGSIZE, 500);
+  sbrk(-MEGAPGSIZE);
+  printf("megapagetest: %s OK\n", testname);
+}
+
+int
+main(int argc, char *argv[])
+{
+  promotetest();
+  forktest();
+  splittest();
+  printf("megapagetest: all tests succeeded\n");
+  exit(0);
+}
@@ -0,0 +1,310 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "kernel/fcntl.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define MAPFAILED ((char *)0xffffffffffffffffL)
+#define NSCAN 64  // pages in the file scanned by the benchmark
+
+char *testname = "???";
+char buf[PGSIZE];
+
+void
+err(char *why)
+{
+  printf("mmaptest: %s failed: %s, pid=%d\n", testname, why, getpid());
+  exit(1);
+}
+
+// make a file of n bytes, where byte i is 'A' + i % 23.
+void
+makefile(char *f, int n)
+{
+  int fd, i, m;
+
+  unlink(f);
+  if((fd = open(f, O_WRONLY | O_CREATE)) < 0)
+    err("open");
+  for(i = 0; i < n; i += m){
+    m = n - i < PGSIZE ? n - i : PGSIZE;
+    for(int j = 0; j < m; j++)
+      buf[j] = 'A' + (i + j) % 23;
+    if(write(fd, buf, m) != m)
+      err("write");
+  }
+  close(fd);
+}
+
+// check that p holds bytes [off, off+n) of a makefile() file,
+// followed by zeroes up to the end of the page.
+void
+checkbytes(char *p, int off, int n)
+{
+  for(int i = 0; i < n; i++)
+    if(p[i] != 'A' + (off + i) % 23)
+      err("wrong byte");
+  for(int i = n; i % PGSIZE != 0; i++)
+    if(p[i] != 0)
+      err("no zero past end of file");
+}
+
+// run f in a child, and check that it is killed.
+void
+expectkill(void (*f)(char *), char *p)
+{
+  int xstatus;
+
+  if(fork() == 0){
+    f(p);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1)
+    err("access to bad address not killed");
+}
+
+void
+readpage(char *p)
+{
+  volatile char c = *p;
+  (void)c;
+}
+
+void
+writepage(char *p)
+{
+  *p = 'x';
+}
+
+void
+privatetest(void)
+{
+  char *f = "mmap.private";
+  char *p;
+  int fd, n = PGSIZE * 2 + PGSIZE / 2;
+
+  testname = "private";
+  makefile(f, n);
+  if((fd = open(f, O_RDONLY)) < 0)
+    err("open");
+  p = mmap(0, PGSIZE * 3, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == MAPFAILED)
+    err("mmap");
+  close(fd);
+
+  checkbytes(p, 0, n);
+  // private changes don't reach the file.
+  memset(p, 'z', PGSIZE);
+  if(munmap(p, PGSIZE * 3) < 0)
+    err("munmap");
+  if((fd = open(f, O_RDONLY)) < 0)
+    err("open");
+  if(read(fd, buf, PGSIZE) != PGSIZE)
+    err("read");
+  close(fd);
+  checkbytes(buf, 0, PGSIZE);
+
+  // a read-only mapping can't be written, even by the kernel.
+  if((fd = open(f, O_RDONLY)) < 0)
+    err("open");
+  p = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, PGSIZE);
+  if(p == MAPFAILED)
+    err("mmap");
+  checkbytes(p, PGSIZE, PGSIZE);
+  if(read(fd, p, 10) > 0)
+    err("read() into read-only mapping");
+  expectkill(writepage, p);
+  close(fd);
+  munmap(p, PGSIZE);
+
+  // a shared writable mapping needs a writable file.
+  if((fd = open(f, O_RDONLY)) < 0)
+    err("open");
+  if(mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) != MAPFAILED)
+    err("mmap shared of read-only file");
+  close(fd);
+  unlink(f);
+  printf("mmaptest: %s OK\n", testname);
+}
+
+void
+sharedtest(void)
+{
+  char *f = "mmap.shared";
+  char *p;
+  int fd, n = PGSIZE * 2 + 100;
+  struct stat st;
+
+  testname = "shared";
+  makefile(f, n);
+  if((fd = open(f, O_RDWR)) < 0)
+    err("open");
+  p = mmap(0, n, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAPFAILED)
+    err("mmap");
+
+  // a store, and a read() into the mapping, are both written back.
+  p[0] = '0';
+  p[PGSIZE * 2 + 99] = '1';
+  if(read(fd, p + PGSIZE, 2) != 2 || p[PGSIZE] != 'A' || p[PGSIZE + 1] != 'B')
+    err("read into mapping");
+  // past the end of the file, not written back.
+  p[PGSIZE * 2 + 100] = '2';
+  if(munmap(p, n) < 0)
+    err("munmap");
+
+  if(fstat(fd, &st) < 0 || st.size != n)
+    err("file size changed");
+  close(fd);
+  if((fd = open(f, O_RDONLY)) < 0)
+    err("open");
+  if(read(fd, buf, PGSIZE) != PGSIZE || buf[0] != '0')
+    err("first page not written back");
+  if(read(fd, buf, PGSIZE) != PGSIZE || buf[0] != 'A' || buf[1] != 'B')
+    err("read() into mapping not written back");
+  if(read(fd, buf, PGSIZE) != 100 || buf[99] != '1')
+    err("last page not written back");
+  close(fd);
+
+  // exit() writes back too.
+  if(fork() == 0){
+    if((fd = open(f, O_RDWR)) < 0)
+      err("open");
+    p = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(p == MAPFAILED)
+      err("mmap");
+    close(fd);
+    p[1] = '3';
+    exit(0);
+  }
+  wait(0);
+  if((fd = open(f, O_RDONLY)) < 0)
+    err("open");
+  if(read(fd, buf, 2) != 2 || buf[0] != '0' || buf[1] != '3')
+    err("not written back on exit");
+  close(fd);
+  unlink(f);
+  printf("mmaptest: %s OK\n", testname);
+}
+
+void
+unmaptest(void)
+{
+  char *p;
+
+  testname = "munmap";
+  p = mmap(0, PGSIZE * 4, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(p == MAPFAILED)
+    err("mmap");
+  for(int i = 0; i < PGSIZE * 4; i++)
+    if(p[i] != 0)
+      err("anonymous memory not zero");
+  for(int i = 0; i < 4; i++)
+    p[i * PGSIZE] = 'a' + i;
+
+  // punch a hole in the middle, then trim both ends.
+  if(munmap(p + PGSIZE, PGSIZE) < 0)
+    err("munmap middle");
+  expectkill(readpage, p + PGSIZE);
+  if(p[0] != 'a' || p[2 * PGSIZE] != 'c' || p[3 * PGSIZE] != 'd')
+    err("lost data");
+  if(munmap(p, PGSIZE) < 0 || munmap(p + 3 * PGSIZE, PGSIZE) < 0)
+    err("munmap ends");
+  expectkill(readpage, p);
+  expectkill(readpage, p + 3 * PGSIZE);
+  if(p[2 * PGSIZE] != 'c')
+    err("lost data");
+  if(munmap(p, PGSIZE * 4) < 0)
+    err("munmap all");
+  expectkill(readpage, p + 2 * PGSIZE);
+  printf("mmaptest: %s OK\n", testname);
+}
+
+void
+forktest(void)
+{
+  char *priv, *shared;
+  int xstatus;
+
+  testname = "fork";
+  priv = mmap(0, PGSIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  shared = mmap(0, PGSIZE * 2, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(priv == MAPFAILED || shared == MAPFAILED)
+    err("mmap");
+  priv[0] = 'p';
+
+  if(fork() == 0){
+    if(priv[0] != 'p')
+      err("child lost private data");
+    priv[0] = 'c';
+    shared[0] = 'c';
+    shared[PGSIZE] = 'C';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  if(priv[0] != 'p')
+    err("child's private write seen by parent");
+  if(shared[0] != 'c' || shared[PGSIZE] != 'C')
+    err("child's shared write not seen by parent");
+  munmap(priv, PGSIZE * 2);
+  munmap(shared, PGSIZE * 2);
+  printf("mmaptest: %s OK\n", testname);
+}
+
+// compare scanning a file with read() and with mmap().
+void
+scanbench(void)
+{
+  char *f = "mmap.scan";
+  int fd, n, t0, t1, t2;
+  uint sum1 = 0, sum2 = 0;
+  char *p;
+
+  testname = "scan";
+  makefile(f, NSCAN * PGSIZE);
+
+  t0 = uptime();
+  for(int r = 0; r < 10; r++){
+    if((fd = open(f, O_RDONLY)) < 0)
+      err("open");
+    while((n = read(fd, buf, PGSIZE)) > 0)
+      for(int i = 0; i < n; i++)
+        sum1 += buf[i];
+    close(fd);
+  }
+  t1 = uptime();
+  for(int r = 0; r < 10; r++){
+    if((fd = open(f, O_RDONLY)) < 0)
+      err("open");
+    p = mmap(0, NSCAN * PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(p == MAPFAILED)
+      err("mmap");
+    for(int i = 0; i < NSCAN * PGSIZE; i++)
+      sum2 += p[i];
+    munmap(p, NSCAN * PGSIZE);
+  }
+  t2 = uptime();
+
+  if(sum1 != sum2)
+    err("sums differ");
+  unlink(f);
+  printf("mmaptest: %s %d KB x 10: read %d ticks, mmap %d ticks\n",
+         testname, NSCAN * PGSIZE / 1024, t1 - t0, t2 - t1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  privatetest();
+  sharedtest();
+  unmaptest();
+  forktest();
+  scanbench();
+  printf("mmaptest: all tests succeeded\n");
+  exit(0);
+}
@@ -0,0 +1,78 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+// Check pgstate(): after its bits are cleared, it reports just
+// the pages read and written since, over a range that spans
+// several leaf page tables.
+
+#define NPAGE 1300
+
+char *testname = "???";
+uchar abits[(NPAGE + 7) / 8], dbits[(NPAGE + 7) / 8];
+
+void
+err(char *why)
+{
+  printf("pgstatetest: %s failed: %s, pid=%d\n", testname, why, getpid());
+  exit(1);
+}
+
+int
+bit(uchar *bits, int i)
+{
+  return (bits[i / 8] >> (i % 8)) & 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+  volatile char *p;
+  int i;
+
+  testname = "clear";
+  if((p = sbrk(NPAGE * PGSIZE)) == (char *)-1)
+    err("sbrk");
+  // read each page first, so that the writes don't get megapages,
+  // whose bits are shared by 512 pages.
+  for(i = 0; i < NPAGE; i++)
+    if(p[(uint64)i * PGSIZE] != 0)
+      err("new memory not zero");
+  for(i = 0; i < NPAGE; i++)
+    p[(uint64)i * PGSIZE] = i;
+  if(pgstate((void *)p, NPAGE, abits, dbits, PGS_CLEARA | PGS_CLEARD) < 0)
+    err("pgstate");
+  for(i = 0; i < NPAGE; i++)
+    if(!bit(abits, i) || !bit(dbits, i))
+      err("written page not reported");
+  if(pgstate((void *)p, NPAGE, abits, dbits, 0) < 0)
+    err("pgstate");
+  for(i = 0; i < NPAGE; i++)
+    if(bit(abits, i) || bit(dbits, i))
+      err("bits not cleared");
+  printf("pgstatetest: %s OK\n", testname);
+
+  // write a third of the pages, read a third, leave the rest.
+  testname = "sample";
+  for(i = 0; i < NPAGE; i++){
+    if(i % 3 == 0)
+      p[(uint64)i * PGSIZE] = 1;
+    else if(i % 3 == 1 && p[(uint64)i * PGSIZE] != (char)i)
+      err("wrong data");
+  }
+  if(pgstate((void *)p, NPAGE, abits, dbits, PGS_CLEARA) < 0)
+    err("pgstate");
+  for(i = 0; i < NPAGE; i++)
+    if(bit(abits, i) != (i % 3 != 2) || bit(dbits, i) != (i % 3 == 0))
+      err("wrong bits");
+  // the dirty bits are still there; the accessed ones aren't.
+  if(pgstate((void *)p, NPAGE, abits, dbits, 0) < 0)
+    err("pgstate");
+  for(i = 0; i < NPAGE; i++)
+    if(bit(abits, i) || bit(dbits, i) != (i % 3 == 0))
+      err("wrong bits after clearing accessed");
+  printf("pgstatetest: %s OK\n", testname);
+  exit(0);
+}
@@ -0,0 +1,98 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "kernel/fcntl.h"
+#include "kernel/sysinfo.h"
+#include "user/user.h"
+
+// Check that page-table pages are freed when the memory they
+// map goes: growing and shrinking the heap, and mapping and
+// unmapping, over and over, must leave free memory where it was.
+
+#define NCYCLE 1000000        // sbrk() up and down across a 2 MB line
+#define NMAP   10000          // mmap() and munmap()
+#define BIG    (32 * 1024 * 1024)
+
+char *testname = "???";
+
+void
+err(char *why)
+{
+  printf("ptfreetest: %s failed: %s, pid=%d\n", testname, why, getpid());
+  exit(1);
+}
+
+uint64
+freemem(void)
+{
+  struct sysinfo si;
+
+  if(sysinfo(&si) < 0)
+    err("sysinfo");
+  return si.freemem;
+}
+
+void
+check(uint64 before)
+{
+  uint64 now = freemem();
+
+  if(now != before){
+    printf("ptfreetest: %s: free memory %d KB, was %d KB\n", testname,
+           (int)(now / 1024), (int)(before / 1024));
+    err("page-table pages not freed");
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  volatile char *p;
+  uint64 before, sz;
+
+  // sbrk() reserves a leaf table for each 2 MB; reading maps
+  // the zero page, so only the tables take memory.
+  testname = "big";
+  before = freemem();
+  if((p = sbrk(BIG)) == (char *)-1)
+    err("sbrk");
+  for(uint64 i = 0; i < BIG; i += MEGAPGSIZE)
+    if(p[i] != 0)
+      err("new memory not zero");
+  if(sbrk(-BIG) == (char *)-1)
+    err("sbrk");
+  check(before);
+  printf("ptfreetest: %s OK\n", testname);
+
+  // end the heap one page short of a 2 MB line, so that each
+  // cycle needs a new leaf table.
+  testname = "cycle";
+  sz = (uint64)sbrk(0);
+  if(sbrk(MEGAPGSIZE - sz % MEGAPGSIZE - PGSIZE) == (char *)-1)
+    err("sbrk");
+  before = freemem();
+  for(int i = 0; i < NCYCLE; i++){
+    if((p = sbrk(2 * PGSIZE)) == (char *)-1)
+      err("sbrk");
+    p[PGSIZE] = i;
+    if(sbrk(-2 * PGSIZE) == (char *)-1)
+      err("sbrk");
+  }
+  check(before);
+  printf("ptfreetest: %s OK\n", testname);
+
+  // a mapping takes a level-1 table of its own, too.
+  testname = "mmap";
+  before = freemem();
+  for(int i = 0; i < NMAP; i++){
+    p = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == (char *)-1)
+      err("mmap");
+    p[0] = i;
+    if(munmap((void *)p, PGSIZE) < 0)
+      err("munmap");
+  }
+  check(before);
+  printf("ptfreetest: %s OK\n", testname);
+  exit(0);
+}
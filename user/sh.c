@@ -3,6 +3,7 @@
 #include "kernel/types.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
+#include "kernel/spawn.h"
 
 // Parsed command representation
 #define EXEC  1
@@ -52,6 +53,7 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+void freecmd(struct cmd*);
 void runcmd(struct cmd*) __attribute__((noreturn));
 
 // Execute cmd.  Never returns.
@@ -131,6 +133,81 @@ runcmd(struct cmd *cmd)
   exit(0);
 }
 
+// Is cmd a command with redirections, or a pipeline of them,
+// which the shell can spawn() without forking itself?
+int
+spawnable(struct cmd *cmd)
+{
+  switch(cmd->type){
+  case EXEC:
+    return ((struct execcmd*)cmd)->argv[0] != 0;
+  case REDIR:
+    return spawnable(((struct redircmd*)cmd)->cmd);
+  case PIPE:
+    return spawnable(((struct pipecmd*)cmd)->left) &&
+           spawnable(((struct pipecmd*)cmd)->right);
+  }
+  return 0;
+}
+
+// Start the spawnable() cmd, with in and out (if not -1) as
+// standard input and output. Returns the number of processes
+// started, for the caller to wait() for.
+int
+spawncmd(struct cmd *cmd, int in, int out)
+{
+  struct spawnfa fa[MAXSPAWNFA];
+  struct redircmd *rcmd;
+  struct pipecmd *pcmd;
+  struct execcmd *ecmd;
+  int fds[MAXSPAWNFA], nfa = 0, nfds = 0, n = 0, p[2];
+
+  if(cmd->type == PIPE){
+    pcmd = (struct pipecmd*)cmd;
+    if(pipe(p) < 0){
+      fprintf(2, "pipe failed\n");
+      return 0;
+    }
+    n = spawncmd(pcmd->left, in, p[1]);
+    close(p[1]);
+    n += spawncmd(pcmd->right, p[0], out);
+    close(p[0]);
+    return n;
+  }
+
+  if(in >= 0)
+    fa[nfa++] = (struct spawnfa){ SPAWN_DUP2, in, 0 };
+  if(out >= 0)
+    fa[nfa++] = (struct spawnfa){ SPAWN_DUP2, out, 1 };
+  // the outermost redirection first, as runcmd() does.
+  for(; cmd->type == REDIR; cmd = rcmd->cmd){
+    rcmd = (struct redircmd*)cmd;
+    if(nfa == MAXSPAWNFA - 2){
+      fprintf(2, "too many redirections\n");
+      goto out;
+    }
+    if((fds[nfds] = open(rcmd->file, rcmd->mode)) < 0){
+      fprintf(2, "open %s failed\n", rcmd->file);
+      goto out;
+    }
+    fa[nfa++] = (struct spawnfa){ SPAWN_DUP2, fds[nfds++], rcmd->fd };
+  }
+  // leave the child only 0, 1 and 2.
+  fa[nfa++] = (struct spawnfa){ SPAWN_CLOSEFROM, 3, 0 };
+  fa[nfa] = (struct spawnfa){ SPAWN_END, 0, 0 };
+
+  ecmd = (struct execcmd*)cmd;
+  if(spawn(ecmd->argv[0], ecmd->argv, fa) < 0)
+    fprintf(2, "exec %s failed\n", ecmd->argv[0]);
+  else
+    n = 1;
+
+out:
+  while(nfds > 0)
+    close(fds[--nfds]);
+  return n;
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -146,7 +223,8 @@ int
 main(void)
 {
   static char buf[100];
-  int fd;
+  struct cmd *cmd;
+  int fd, n;
 
   // Ensure that three file descriptors are open.
   while((fd = open("console", O_RDWR)) >= 0){
@@ -165,9 +243,20 @@ main(void)
         fprintf(2, "cannot cd %s\n", buf+3);
       continue;
     }
-    if(fork1() == 0)
-      runcmd(parsecmd(buf));
-    wait(0);
+    // parsed here, so that simple commands can be spawned; a
+    // syntax error mustn't end the shell.
+    if((cmd = parsecmd(buf)) == 0)
+      continue;
+    if(spawnable(cmd)){
+      // no need to copy the shell just to replace the copy.
+      for(n = spawncmd(cmd, -1, -1); n > 0; n--)
+        wait(0);
+    } else {
+      if(fork1() == 0)
+        runcmd(cmd);
+      wait(0);
+    }
+    freecmd(cmd);
   }
   exit(0);
 }
@@ -261,6 +350,7 @@ backcmd(struct cmd *subcmd)
 // Parsing
 
 char whitespace[] = " \t\r\n\v";
+int parseerr;  // parsecmd() found a syntax error
 char symbols[] = "<|>&;()";
 
 int
@@ -325,6 +415,18 @@ struct cmd *parsepipe(char**, char*);
 struct cmd *parseexec(char**, char*);
 struct cmd *nulterminate(struct cmd*);
 
+// Report a syntax error; parsing goes on to the end of the line,
+// for parsecmd() to throw the result away.
+void
+syntax(char *s)
+{
+  if(!parseerr)
+    fprintf(2, "%s\n", s);
+  parseerr = 1;
+}
+
+// Returns the parsed command, to be freed with freecmd(), or 0
+// if s has a syntax error.
 struct cmd*
 parsecmd(char *s)
 {
@@ -334,9 +436,14 @@ parsecmd(char *s)
   es = s + strlen(s);
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if(s != es){
+  if(s != es && !parseerr){
     fprintf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
+  }
+  if(parseerr){
+    parseerr = 0;
+    freecmd(cmd);
+    return 0;
   }
   nulterminate(cmd);
   return cmd;
@@ -380,8 +487,10 @@ parseredirs(struct cmd *cmd, char **ps, char *es)
 
   while(peek(ps, es, "<>")){
     tok = gettoken(ps, es, 0, 0);
-    if(gettoken(ps, es, &q, &eq) != 'a')
-      panic("missing file for redirection");
+    if(gettoken(ps, es, &q, &eq) != 'a'){
+      syntax("missing file for redirection");
+      break;
+    }
     switch(tok){
     case '<':
       cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -406,8 +515,10 @@ parseblock(char **ps, char *es)
     panic("parseblock");
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
-  if(!peek(ps, es, ")"))
-    panic("syntax - missing )");
+  if(!peek(ps, es, ")")){
+    syntax("syntax - missing )");
+    return cmd;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -432,13 +543,17 @@ parseexec(char **ps, char *es)
   while(!peek(ps, es, "|)&;")){
     if((tok=gettoken(ps, es, &q, &eq)) == 0)
       break;
-    if(tok != 'a')
-      panic("syntax");
+    if(tok != 'a'){
+      syntax("syntax");
+      break;
+    }
+    if(argc >= MAXARGS - 1){
+      syntax("too many args");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if(argc >= MAXARGS)
-      panic("too many args");
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -492,3 +607,29 @@ nulterminate(struct cmd *cmd)
   }
   return cmd;
 }
+
+// Free the nodes of cmd; the strings are in the input line.
+void
+freecmd(struct cmd *cmd)
+{
+  if(cmd == 0)
+    return;
+
+  switch(cmd->type){
+  case REDIR:
+    freecmd(((struct redircmd*)cmd)->cmd);
+    break;
+  case PIPE:
+    freecmd(((struct pipecmd*)cmd)->left);
+    freecmd(((struct pipecmd*)cmd)->right);
+    break;
+  case LIST:
+    freecmd(((struct listcmd*)cmd)->left);
+    freecmd(((struct listcmd*)cmd)->right);
+    break;
+  case BACK:
+    freecmd(((struct backcmd*)cmd)->cmd);
+    break;
+  }
+  free(cmd);
+}
@@ -0,0 +1,186 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "kernel/sysinfo.h"
+#include "user/user.h"
+
+// Check shared memory segments, then compare moving data from
+// one process to another through a pipe, which copies every
+// byte into and out of the kernel, with a ring buffer in a
+// shared segment, which the two processes both map.
+
+#define MAPFAILED ((char *)0xffffffffffffffffL)
+#define TOTAL (4 * 1024 * 1024)  // bytes moved by each benchmark
+#define CHUNK 4096
+#define RINGPG 16                // data pages in the ring
+
+char *testname = "???";
+char buf[CHUNK];
+
+void
+err(char *why)
+{
+  printf("shmbench: %s failed: %s, pid=%d\n", testname, why, getpid());
+  exit(1);
+}
+
+uint64
+freemem(void)
+{
+  struct sysinfo info;
+
+  if(sysinfo(&info) < 0)
+    err("sysinfo");
+  return info.freemem;
+}
+
+// fork() shares a segment, and mapping its key again, at a
+// chosen address, maps the same pages.
+void
+sharetest(void)
+{
+  char *p, *q, *want = (char *)(2L << 30);
+  int xstatus;
+
+  testname = "share";
+  if((p = shmmap(1, 2 * PGSIZE, 0)) == MAPFAILED)
+    err("shmmap");
+  if(p[0] != 0 || p[2 * PGSIZE - 1] != 0)
+    err("new segment not zero");
+  p[0] = 'p';
+
+  if(fork() == 0){
+    if(p[0] != 'p')
+      err("child doesn't see parent's data");
+    if((q = shmmap(1, PGSIZE, want)) != want)
+      err("shmmap at chosen address");
+    if(q[0] != 'p')
+      err("second mapping doesn't see data");
+    q[PGSIZE - 1] = 'q';
+    p[PGSIZE] = 'c';
+    if(shmmap(1, 3 * PGSIZE, 0) != MAPFAILED)
+      err("mapped past the end of the segment");
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  if(p[PGSIZE - 1] != 'q' || p[PGSIZE] != 'c')
+    err("parent doesn't see child's data");
+  if(munmap(p, 2 * PGSIZE) < 0)
+    err("munmap");
+  printf("shmbench: %s OK\n", testname);
+}
+
+// a segment's pages are freed when its last mapping goes.
+void
+freetest(void)
+{
+  uint64 before;
+  char *p, *q;
+
+  testname = "free";
+  before = freemem();
+  if((p = shmmap(2, 64 * PGSIZE, 0)) == MAPFAILED)
+    err("shmmap");
+  if((q = shmmap(2, 64 * PGSIZE, 0)) == MAPFAILED)
+    err("shmmap");
+  for(int i = 0; i < 64; i++)
+    p[i * PGSIZE] = i;
+  if(munmap(p, 64 * PGSIZE) < 0)
+    err("munmap");
+  for(int i = 0; i < 64; i++)
+    if(q[i * PGSIZE] != i)
+      err("lost data after first munmap");
+  if(munmap(q, 64 * PGSIZE) < 0)
+    err("munmap");
+  if(freemem() < before)
+    err("pages not freed");
+
+  // a new segment with the same key starts out zero.
+  if((p = shmmap(2, PGSIZE, 0)) == MAPFAILED)
+    err("shmmap");
+  if(p[0] != 0)
+    err("old contents survived");
+  munmap(p, PGSIZE);
+  printf("shmbench: %s OK\n", testname);
+}
+
+int
+pipebench(void)
+{
+  int fds[2], n, t0, got = 0;
+
+  testname = "pipe";
+  if(pipe(fds) < 0)
+    err("pipe");
+  t0 = uptime();
+  if(fork() == 0){
+    close(fds[0]);
+    for(int i = 0; i < TOTAL; i += CHUNK)
+      if(write(fds[1], buf, CHUNK) != CHUNK)
+        err("write");
+    exit(0);
+  }
+  close(fds[1]);
+  while((n = read(fds[0], buf, CHUNK)) > 0)
+    got += n;
+  close(fds[0]);
+  wait(0);
+  if(got != TOTAL)
+    err("short read");
+  return uptime() - t0;
+}
+
+// A ring of RINGPG pages that follows its indices in the segment.
+// The producer only writes head, the consumer only tail; each
+// waits by spinning, so the two should run on different CPUs.
+struct ring {
+  volatile uint64 head;   // bytes produced
+  volatile uint64 tail;   // bytes consumed
+};
+
+int
+shmbench(void)
+{
+  struct ring *r;
+  char *data;
+  uint64 off;
+  int t0;
+
+  testname = "shm";
+  if((r = (struct ring *)shmmap(3, (RINGPG + 1) * PGSIZE, 0)) == (struct ring *)MAPFAILED)
+    err("shmmap");
+  data = (char *)r + PGSIZE;
+  t0 = uptime();
+  if(fork() == 0){
+    for(off = 0; off < TOTAL; off += CHUNK){
+      while(r->head - r->tail == RINGPG * PGSIZE)
+        ;
+      memmove(data + off % (RINGPG * PGSIZE), buf, CHUNK);
+      __sync_synchronize();
+      r->head = off + CHUNK;
+    }
+    exit(0);
+  }
+  for(off = 0; off < TOTAL; off += CHUNK){
+    while(r->head == off)
+      ;
+    __sync_synchronize();
+    memmove(buf, data + off % (RINGPG * PGSIZE), CHUNK);
+    r->tail = off + CHUNK;
+  }
+  wait(0);
+  munmap(r, (RINGPG + 1) * PGSIZE);
+  return uptime() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  sharetest();
+  freetest();
+  printf("shmbench: %d KB: pipe %d ticks, shm %d ticks\n",
+         TOTAL / 1024, pipebench(), shmbench());
+  exit(0);
+}
@@ -0,0 +1,153 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "kernel/sysinfo.h"
+#include "user/user.h"
+
+// Check paging to swap: fill more memory than the machine has,
+// and see that every page still holds what was written to it,
+// through fork(), pipes, and shrinking. Every other page is
+// filled with random bytes, which don't compress and so go to
+// disk; the rest are mostly zero and are kept compressed.
+
+#define EXTRA (8 * 1024 * 1024)  // bytes to ask for beyond free memory
+#define NCHILD 1024              // pages the child writes
+
+char *testname = "???";
+
+void
+err(char *why)
+{
+  printf("swaptest: %s failed: %s, pid=%d\n", testname, why, getpid());
+  exit(1);
+}
+
+void
+info(struct sysinfo *si)
+{
+  if(sysinfo(si) < 0)
+    err("sysinfo");
+}
+
+// the word at the start of page i holds i * 7 + 1, and if i is
+// even, the rest of the page is random. the child writes -i in
+// the first word.
+uint
+next(uint *x)
+{
+  *x ^= *x << 13;
+  *x ^= *x >> 17;
+  *x ^= *x << 5;
+  return *x;
+}
+
+void
+fill(char *p, int i)
+{
+  uint *w = (uint *)(p + (uint64)i * PGSIZE), x = i + 1;
+
+  w[0] = i * 7 + 1;
+  if(i % 2 == 0)
+    for(int j = 1; j < PGSIZE / sizeof(uint); j++)
+      w[j] = next(&x);
+}
+
+int
+check(char *p, int i, int child)
+{
+  uint *w = (uint *)(p + (uint64)i * PGSIZE), x = i + 1;
+
+  if(child)
+    return w[0] == -i;
+  if(w[0] != i * 7 + 1)
+    return 0;
+  for(int j = 1; j < PGSIZE / sizeof(uint); j++)
+    if(w[j] != (i % 2 == 0 ? next(&x) : 0))
+      return 0;
+  return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct sysinfo si;
+  char *p;
+  int n, fds[2], xstatus;
+  uint64 used;
+
+  testname = "fill";
+  info(&si);
+  n = (si.freemem + EXTRA) / PGSIZE;
+  if((p = sbrk(n * PGSIZE)) == (char *)-1)
+    err("sbrk");
+  // read each page first, so that the writes don't get megapages,
+  // which stay in memory.
+  for(int i = 0; i < n; i++)
+    if(*(volatile int *)(p + (uint64)i * PGSIZE) != 0)
+      err("new memory not zero");
+  for(int i = 0; i < n; i++)
+    fill(p, i);
+  for(int i = 0; i < n; i++)
+    if(!check(p, i, 0))
+      err("wrong data");
+  info(&si);
+  if(si.swapused == 0)
+    err("nothing on disk");
+  if(si.zpages == 0)
+    err("nothing compressed");
+  printf("swaptest: %s OK: %d pages, %d KB on disk, %d KB compressed to %d KB\n",
+         testname, n, (int)(si.swapused / 1024), (int)(si.zpages * 4),
+         (int)(si.zbytes / 1024));
+  if(si.zfaults > 0 && si.swapfaults > 0)
+    printf("swaptest: fault in from memory %d us, from disk %d us\n",
+           (int)(si.zfaultus / si.zfaults), (int)(si.swapfaultus / si.swapfaults));
+
+  // the first pages went out long ago; the kernel copies from
+  // and to them with a lock held.
+  testname = "pipe";
+  if(pipe(fds) < 0)
+    err("pipe");
+  if(write(fds[1], p, sizeof(int)) != sizeof(int) ||
+     read(fds[0], p + PGSIZE, sizeof(int)) != sizeof(int))
+    err("pipe I/O");
+  close(fds[0]);
+  close(fds[1]);
+  if(*(int *)(p + PGSIZE) != 1)
+    err("wrong data through pipe");
+  *(int *)(p + PGSIZE) = 8;
+  printf("swaptest: %s OK\n", testname);
+
+  // the child sees the parent's pages, on swap or not, and its
+  // writes don't show through.
+  testname = "fork";
+  if(fork() == 0){
+    for(int i = 0; i < n; i += n / 64)
+      if(!check(p, i, 0))
+        err("child sees wrong data");
+    for(int i = 0; i < NCHILD; i++)
+      *(int *)(p + (uint64)i * PGSIZE) = -i;
+    for(int i = 0; i < NCHILD; i++)
+      if(!check(p, i, 1))
+        err("child lost its data");
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  for(int i = 0; i < n; i++)
+    if(!check(p, i, 0))
+      err("parent sees wrong data");
+  printf("swaptest: %s OK\n", testname);
+
+  // giving the memory back frees its slots.
+  testname = "shrink";
+  info(&si);
+  used = si.swapused;
+  if(sbrk(-n * PGSIZE) == (char *)-1)
+    err("sbrk");
+  info(&si);
+  if(si.swapused >= used)
+    err("swap not freed");
+  printf("swaptest: %s OK\n", testname);
+  exit(0);
+}
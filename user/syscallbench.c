@@ -0,0 +1,130 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "kernel/fcntl.h"
+#include "kernel/sysinfo.h"
+#include "user/user.h"
+
+// Measure system call latency, alone and with a working set of
+// user pages touched between calls. Run it on a kernel built
+// with and without NOASID=1 to see what flushing the TLB on
+// every trap costs. Also measure how fast data moves through
+// a pipe, and how long system calls that copy to and from user
+// memory take, both with memory the kernel reaches directly and
+// with mmap() memory, above PLIC, that it reaches by walking the
+// page table.
+
+#define NCALL 100000
+#define NPAGE 64
+#define NPIPE (4 * 1024 * 1024)  // bytes sent through the pipe
+
+char pages[NPAGE * PGSIZE];
+
+// run n system calls, touching npage pages before each one.
+// returns elapsed ticks.
+int
+bench(int n, int npage)
+{
+  int t0 = uptime();
+
+  for(int i = 0; i < n; i++){
+    for(int j = 0; j < npage; j++)
+      pages[j * PGSIZE] += 1;
+    getpid();
+  }
+  return uptime() - t0;
+}
+
+// send NPIPE bytes through a pipe to a child, in writes of
+// pages worth of data. returns elapsed ticks.
+int
+pipebench(void)
+{
+  int fds[2], n, t0;
+  long total;
+
+  if(pipe(fds) < 0){
+    printf("syscallbench: pipe failed\n");
+    exit(1);
+  }
+  t0 = uptime();
+  if(fork() == 0){
+    close(fds[1]);
+    total = 0;
+    while((n = read(fds[0], pages, sizeof(pages))) > 0)
+      total += n;
+    exit(total == NPIPE ? 0 : 1);
+  }
+  close(fds[0]);
+  for(total = 0; total < NPIPE; total += sizeof(pages)){
+    if(write(fds[1], pages, sizeof(pages)) != sizeof(pages)){
+      printf("syscallbench: pipe write failed\n");
+      exit(1);
+    }
+  }
+  close(fds[1]);
+  wait(&n);
+  if(n != 0){
+    printf("syscallbench: pipe lost data\n");
+    exit(1);
+  }
+  return uptime() - t0;
+}
+
+// n times, write len bytes from buf to a pipe and read them back
+// into buf, then copy a struct sysinfo out to buf.
+// returns elapsed ticks.
+int
+copybench(int n, char *buf, int len)
+{
+  int fds[2], t0;
+
+  if(pipe(fds) < 0){
+    printf("syscallbench: pipe failed\n");
+    exit(1);
+  }
+  t0 = uptime();
+  for(int i = 0; i < n; i++){
+    if(write(fds[1], buf, len) != len || read(fds[0], buf, len) != len){
+      printf("syscallbench: pipe failed\n");
+      exit(1);
+    }
+    sysinfo((struct sysinfo *)buf);
+  }
+  t0 = uptime() - t0;
+  close(fds[0]);
+  close(fds[1]);
+  return t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n = NCALL, t;
+
+  if(argc > 1)
+    n = atoi(argv[1]);
+
+  // fault all the pages in first.
+  bench(1, NPAGE);
+
+  t = bench(n, 0);
+  printf("syscallbench: %d getpid(): %d ticks\n", n, t);
+  t = bench(n, NPAGE);
+  printf("syscallbench: %d getpid() touching %d pages: %d ticks\n", n, NPAGE, t);
+  t = pipebench();
+  printf("syscallbench: %d KB through a pipe: %d ticks\n", NPIPE / 1024, t);
+
+  char *m = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(m == (char *)-1){
+    printf("syscallbench: mmap failed\n");
+    exit(1);
+  }
+  for(int len = 8; len <= 512; len *= 8){
+    t = copybench(n / 10, pages, len);
+    printf("syscallbench: %d copies of %d bytes, direct: %d ticks\n", n / 10, len, t);
+    t = copybench(n / 10, m, len);
+    printf("syscallbench: %d copies of %d bytes, page walk: %d ticks\n", n / 10, len, t);
+  }
+  exit(0);
+}
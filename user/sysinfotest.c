@@ -1,5 +1,7 @@
 #include "kernel/types.h"
+#include "kernel/param.h"
 #include "kernel/riscv.h"
+#include "kernel/fcntl.h"
 #include "kernel/sysinfo.h"
 #include "user/user.h"
 
@@ -13,27 +15,25 @@ sinfo(struct sysinfo *info) {
 }
 
 //
-// use sbrk() to count how many free physical memory pages there are.
+// use sbrk() to take all the memory there is. sbrk() lets the heap
+// grow past free memory by as much swap as is free, paging the
+// process out as it goes, so this gets at least what was free.
 //
-int
+uint64
 countfree()
 {
   uint64 sz0 = (uint64)sbrk(0);
-  struct sysinfo info;
-  int n = 0;
+  uint64 n = 0;
 
   while(1){
-    if((uint64)sbrk(PGSIZE) == 0xffffffffffffffff){
+    char *a = sbrk(PGSIZE);
+    if((uint64)a == 0xffffffffffffffff){
       break;
     }
+    // sbrk() allocates lazily; touch the page to allocate it.
+    *a = 1;
     n += PGSIZE;
   }
-  sinfo(&info);
-  if (info.freemem != 0) {
-    printf("FAIL: there is no free mem, but sysinfo.freemem=%d\n",
-      info.freemem);
-    exit(1);
-  }
   sbrk(-((uint64)sbrk(0) - sz0));
   return n;
 }
@@ -41,24 +41,37 @@ countfree()
 void
 testmem() {
   struct sysinfo info;
-  uint64 n = countfree();
-  
-  sinfo(&info);
+  uint64 f0, n;
 
-  if (info.freemem!= n) {
-    printf("FAIL: free mem %d (bytes) instead of %d\n", info.freemem, n);
+  sinfo(&info);
+  f0 = info.freemem;
+  n = countfree();
+  // less a page-table page for each 2 MB of heap.
+  if (n + (n / MEGAPGSIZE + 1) * PGSIZE < f0) {
+    printf("FAIL: sbrk got %d bytes, but %d were free\n", n, f0);
     exit(1);
   }
-  
-  if((uint64)sbrk(PGSIZE) == 0xffffffffffffffff){
+
+  // countfree() may have paged this process out; bring what it
+  // uses back in before counting.
+  sinfo(&info);
+  sinfo(&info);
+  f0 = info.freemem;
+
+  char *a = sbrk(PGSIZE);
+  if((uint64)a == 0xffffffffffffffff){
     printf("sbrk failed");
     exit(1);
   }
+  // sbrk() may have taken a page-table page.
+  sinfo(&info);
+  n = info.freemem;
+  *a = 1;
 
   sinfo(&info);
     
   if (info.freemem != n-PGSIZE) {
-    printf("FAIL: free mem %d (bytes) instead of %d\n", n-PGSIZE, info.freemem);
+    printf("FAIL: free mem %d (bytes) instead of %d\n", info.freemem, n-PGSIZE);
     exit(1);
   }
   
@@ -69,8 +82,8 @@ testmem() {
 
   sinfo(&info);
     
-  if (info.freemem != n) {
-    printf("FAIL: free mem %d (bytes) instead of %d\n", n, info.freemem);
+  if (info.freemem != f0) {
+    printf("FAIL: free mem %d (bytes) instead of %d\n", info.freemem, f0);
     exit(1);
   }
 }
@@ -141,6 +154,62 @@ void testbad() {
   }
 }
 
+// check the counters that sysinfo reports beyond freemem and nproc.
+void testcounters() {
+  struct sysinfo info, info2;
+  int pid, fd;
+  char buf[16];
+
+  sinfo(&info);
+  if (info.freepages * PGSIZE != info.freemem) {
+    printf("sysinfotest: FAIL freepages %d but freemem %d\n", info.freepages, info.freemem);
+    exit(1);
+  }
+
+  // a child that blocks reading an empty pipe is sleeping.
+  int fds[2];
+  if (pipe(fds) < 0) {
+    printf("sysinfotest: pipe failed\n");
+    exit(1);
+  }
+  pid = fork();
+  if (pid < 0) {
+    printf("sysinfotest: fork failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    close(fds[1]);
+    read(fds[0], buf, 1);
+    exit(0);
+  }
+  close(fds[0]);
+  sleep(2);
+  sinfo(&info2);
+  if (info2.nsleeping < 1 || info2.nsleeping + info2.nrunnable + 1 > info2.nproc) {
+    printf("sysinfotest: FAIL nsleeping %d nrunnable %d nproc %d\n",
+           info2.nsleeping, info2.nrunnable, info2.nproc);
+    exit(1);
+  }
+  close(fds[1]);
+  wait(0);
+
+  // reading the same file twice must hit in the buffer cache.
+  sinfo(&info);
+  for (int i = 0; i < 2; i++) {
+    if ((fd = open("README", O_RDONLY)) < 0) {
+      printf("sysinfotest: open README failed\n");
+      exit(1);
+    }
+    read(fd, buf, sizeof(buf));
+    close(fd);
+  }
+  sinfo(&info2);
+  if (info2.bhits <= info.bhits || info2.bmisses < info.bmisses) {
+    printf("sysinfotest: FAIL bhits %d -> %d\n", info.bhits, info2.bhits);
+    exit(1);
+  }
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -148,6 +217,7 @@ main(int argc, char *argv[])
   testcall();
   testmem();
   testproc();
+  testcounters();
   printf("sysinfotest: OK\n");
   exit(0);
 }
@@ -2,6 +2,8 @@
 #include "kernel/stat.h"
 #include "user/user.h"
 #include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "kernel/fcntl.h"
 
 // Memory allocator by Kernighan and Ritchie,
 // The C programming Language, 2nd ed.  Section 8.7.
@@ -21,12 +23,15 @@ typedef union header Header;
 static Header base;
 static Header *freep;
 
-void
-free(void *ap)
+// the pages inside a freed block at least this big are given
+// back to the kernel, and read as zero when next used.
+#define DONTNEED_MIN (16 * PGSIZE)
+
+static void
+insert(Header *bp)
 {
-  Header *bp, *p;
+  Header *p;
 
-  bp = (Header*)ap - 1;
   for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
     if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
       break;
@@ -43,6 +48,22 @@ free(void *ap)
   freep = p;
 }
 
+void
+free(void *ap)
+{
+  Header *bp;
+  uint64 start, end;
+
+  bp = (Header*)ap - 1;
+  if((uint64)bp->s.size * sizeof(Header) >= DONTNEED_MIN){
+    start = PGROUNDUP((uint64)ap);
+    end = PGROUNDDOWN((uint64)(bp + bp->s.size));
+    if(start < end)
+      madvise((void*)start, end - start, MADV_DONTNEED);
+  }
+  insert(bp);
+}
+
 static Header*
 morecore(uint nu)
 {
@@ -56,7 +77,7 @@ morecore(uint nu)
     return 0;
   hp = (Header*)p;
   hp->s.size = nu;
-  free((void*)(hp + 1));
+  insert(hp);
   return freep;
 }
 
@@ -1,5 +1,6 @@
 struct stat;
 struct sysinfo;
+struct spawnfa;
 
 // system calls
 int fork(void);
@@ -32,6 +33,13 @@ int pgaccess(void *base, int len, void *mask);
 int ugetpid(void);
 #endif
 int fmem(void);
+void *mmap(void*, uint64, int, int, int, uint64);
+int munmap(void*, uint64);
+int spawn(const char*, char**, struct spawnfa*);
+void *shmmap(int, uint64, void*);
+int ksm(int);
+int pgstate(void*, int, void*, void*, int);
+int madvise(void*, uint64, int);
 int trace(int);
 int sysinfo(struct sysinfo *);
 int sigalarm(int ticks, void (*handler)());
@@ -2415,10 +2415,22 @@ stacktest(char *s)
     exit(1);
   }
   wait(&xstatus);
-  if(xstatus == -1)  // kernel killed child?
-    exit(0);
-  else
+  if(xstatus != -1)  // kernel killed child?
     exit(xstatus);
+
+  // nor may the kernel read the guard page for us.
+  int fd = open("stacktest.f", O_CREATE|O_WRONLY);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  if(write(fd, (char *) PGROUNDDOWN(r_sp()) - PGSIZE, 1) != -1){
+    printf("%s: stacktest: wrote from guard page\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("stacktest.f");
+  exit(0);
 }
 
 // check that writes to text segment fault
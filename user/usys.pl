@@ -39,6 +39,13 @@ entry("uptime");
 entry("connect");
 entry("pgaccess");
 entry("fmem");
+entry("mmap");
+entry("munmap");
+entry("spawn");
+entry("shmmap");
+entry("ksm");
+entry("pgstate");
+entry("madvise");
 entry("trace");
 entry("sysinfo");
 entry("sigalarm");